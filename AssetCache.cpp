@@ -0,0 +1,280 @@
+#include "AssetCache.h"
+#include "WorkerPool.h"
+#include "XXHash64.h"
+#include "Logger.h"
+#include "Trace.h"
+#include "Metrics.h"
+#include "PixelFormat.h"
+#include <cstdlib>
+#include <cstring>
+#include "stb_image.h"
+
+// below because "The declaration of a static data member in its class definition is not a definition"
+AssetCache* AssetCache::s_instance;
+
+//////////////////////////////////////////////////////////////////////////
+// Static helpers
+//////////////////////////////////////////////////////////////////////////
+
+ImagePixels::~ImagePixels()
+{
+	if (mapping.base)
+		mapping.Unmap();
+	else if (data)
+		stbi_image_free(data);
+}
+
+static uint32_t ReadBE32(const uint8_t* p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// The PLTE (and tRNS) colours of an indexed PNG, in ARGB. Nothing for other colour types.
+static void ReadPNGPalette(const std::vector<uint8_t>& png, std::vector<uint32_t>& palette)
+{
+	// chunks after the 8 byte signature: length, type, data, crc
+	size_t pos = 8;
+	while (pos + 12 <= png.size()) {
+		uint32_t len = ReadBE32(&png[pos]);
+		const uint8_t* type = &png[pos + 4];
+		const uint8_t* d = &png[pos + 8];
+		if (len > png.size() - pos - 12)
+			break;
+		if (memcmp(type, "IHDR", 4) == 0) {
+			if (len < 13 || d[9] != 3)	// colour type 3 is indexed
+				return;
+		}
+		else if (memcmp(type, "PLTE", 4) == 0) {
+			for (uint32_t i = 0; i + 3 <= len && palette.size() < 256; i += 3)
+				palette.push_back(0xFF000000 | ((uint32_t)d[i] << 16) | ((uint32_t)d[i + 1] << 8) | d[i + 2]);
+		}
+		else if (memcmp(type, "tRNS", 4) == 0) {
+			for (uint32_t i = 0; i < len && i < palette.size(); ++i)
+				palette[i] = (palette[i] & 0x00FFFFFF) | ((uint32_t)d[i] << 24);
+		}
+		else if (memcmp(type, "IDAT", 4) == 0) {
+			break;	// PLTE and tRNS come before the image data
+		}
+		pos += 12 + len;
+	}
+}
+
+// Bytes up to the end of the IEND chunk. The upload is whole 512 byte blocks,
+// what follows IEND is padding and must not change the key.
+static size_t PNGDataSize(const std::vector<uint8_t>& png)
+{
+	size_t pos = 8;
+	while (pos + 12 <= png.size()) {
+		uint32_t len = ReadBE32(&png[pos]);
+		if (len > png.size() - pos - 12)
+			break;
+		bool iend = (memcmp(&png[pos + 4], "IEND", 4) == 0);
+		pos += 12 + len;
+		if (iend)
+			return pos;
+	}
+	return png.size();
+}
+
+// Open addressing colour to palette index, for at most 256 colours
+struct ColourTable {
+	static const uint32_t SLOTS = 1024;
+	uint32_t colours[SLOTS];
+	int16_t indexes[SLOTS];
+	ColourTable() { memset(indexes, 0xff, sizeof(indexes)); }
+	static uint32_t Slot(uint32_t colour) { return (colour * 0x9E3779B1u) >> 22; }
+	int Find(uint32_t colour) const {
+		for (uint32_t s = Slot(colour);; s = (s + 1) & (SLOTS - 1)) {
+			if (indexes[s] < 0 || colours[s] == colour)
+				return indexes[s];
+		}
+	}
+	void Insert(uint32_t colour, int index) {
+		uint32_t s = Slot(colour);
+		while (indexes[s] >= 0)
+			s = (s + 1) & (SLOTS - 1);
+		colours[s] = colour;
+		indexes[s] = (int16_t)index;
+	}
+};
+
+// Fills in the palette and indices of images with at most 256 colours
+static void BuildPalette(ImagePixels* pixels, const std::vector<uint8_t>& png)
+{
+	uint64_t count = pixels->xcount * pixels->ycount;
+	if (count == 0)
+		return;
+	SDHR_TRACE_SCOPE("build_palette", "pixels", (int64_t)count);
+	std::vector<uint32_t> palette;
+	ReadPNGPalette(png, palette);
+	ColourTable table;
+	for (size_t i = 0; i < palette.size(); ++i) {
+		if (table.Find(palette[i]) < 0)
+			table.Insert(palette[i], (int)i);	// a repeated colour maps to its first index
+	}
+	std::vector<uint8_t> indices(count);
+	const uint32_t* src = (const uint32_t*)pixels->data;
+	uint32_t last_colour = src[0];
+	int last_index = -1;
+	for (uint64_t i = 0; i < count; ++i) {
+		uint32_t c = src[i];
+		if (c != last_colour || last_index < 0) {
+			last_index = table.Find(c);
+			if (last_index < 0) {
+				if (palette.size() == 256)
+					return;		// too many colours
+				last_index = (int)palette.size();
+				palette.push_back(c);
+				table.Insert(c, last_index);
+			}
+			last_colour = c;
+		}
+		indices[i] = (uint8_t)last_index;
+	}
+	pixels->palette.swap(palette);
+	pixels->indices.swap(indices);
+}
+
+static DecodedImage LoadCachedPNG(uint64_t key, const std::vector<uint8_t>& png, bool build_palette)
+{
+	uint64_t png_size = png.size();
+	DecodedImage decoded;
+	DiskCacheMapping mapping;
+	if (!DiskCache::GetInstance()->Load(DISK_CACHE_ASSET, key, mapping))
+		return decoded;
+	const DiskCacheHeader* h = mapping.Header();
+	if (h->params[0] != png_size || h->data_bytes != h->params[1] * h->params[2] * 4) {
+		mapping.Unmap();
+		return decoded;
+	}
+	auto pixels = std::make_shared<ImagePixels>();
+	pixels->mapping = mapping;
+	pixels->data = mapping.Data();
+	pixels->xcount = h->params[1];
+	pixels->ycount = h->params[2];
+	pixels->key = key;
+	if (build_palette)
+		BuildPalette(pixels.get(), png);
+	decoded.pixels = pixels;
+	return decoded;
+}
+
+static DecodedImage DecodePNG(const std::vector<uint8_t>& png, uint64_t key, bool build_palette)
+{
+	DecodedImage decoded;
+	int width;
+	int height;
+	int channels;
+	SDHR_TRACE_SCOPE("stbi_decode", "bytes", (int64_t)png.size());
+	uint8_t* data = stbi_load_from_memory(png.data(), (int)png.size(), &width, &height, &channels, 4);
+	if (data == NULL) {
+		decoded.error = stbi_failure_reason();
+		return decoded;
+	}
+	ConvertRGBAToARGB(data, (uint64_t)width * height);
+	auto pixels = std::make_shared<ImagePixels>();
+	pixels->data = data;
+	pixels->xcount = width;
+	pixels->ycount = height;
+	pixels->key = key;
+	if (build_palette)
+		BuildPalette(pixels.get(), png);
+	Metrics::Add(METRIC_DECODED_ASSET_BYTES, pixels->Bytes());
+	decoded.pixels = pixels;
+	return decoded;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Methods
+//////////////////////////////////////////////////////////////////////////
+
+AssetCache::AssetCache()
+	: budget_bytes(256ull << 20), used_bytes(0)
+{
+	const char* indexed = getenv("SDHR_INDEXED_TILES");
+	build_palettes = !(indexed && strcmp(indexed, "0") == 0);
+	DiskCache::GetInstance();	// created here so workers don't race to create it
+	const char* env = getenv("SDHR_ASSET_CACHE_MB");
+	if (env && *env)
+		budget_bytes = (uint64_t)atoll(env) << 20;
+}
+
+AssetCache::~AssetCache()
+{
+}
+
+std::shared_future<DecodedImage> AssetCache::Decode(std::vector<uint8_t>&& png, uint64_t* key)
+{
+	png.resize(PNGDataSize(png));
+	uint64_t hash = XXHash64(png.data(), png.size());
+	uint64_t png_size = png.size();
+	*key = hash;
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	auto it = entries.find(hash);
+	if (it != entries.end() && it->second->png_size == png_size) {
+		lru.splice(lru.begin(), lru, it->second);
+		Metrics::Add(METRIC_ASSET_CACHE_HITS);
+		SDHR_LOG_DEBUG("AssetCache: hit %016llx", (unsigned long long)hash);
+		std::promise<DecodedImage> ready;
+		DecodedImage decoded;
+		decoded.pixels = it->second->pixels;
+		ready.set_value(decoded);
+		return ready.get_future().share();
+	}
+	auto flying = in_flight.find(hash);
+	if (flying != in_flight.end()) {
+		Metrics::Add(METRIC_ASSET_CACHE_HITS);
+		return flying->second;
+	}
+
+	Metrics::Add(METRIC_ASSET_CACHE_MISSES);
+	auto bytes = std::make_shared<std::vector<uint8_t>>(std::move(png));
+	// submitted under the lock, so the worker can't finish before in_flight has the entry
+	std::shared_future<DecodedImage> result = WorkerPool::GetInstance()->Submit([this, bytes, hash, png_size]() {
+		DecodedImage decoded = LoadCachedPNG(hash, *bytes, build_palettes);
+		if (decoded.pixels) {
+			Metrics::Add(METRIC_DISK_CACHE_HITS);
+		}
+		else {
+			decoded = DecodePNG(*bytes, hash, build_palettes);
+			if (decoded.pixels && DiskCache::GetInstance()->IsEnabled()) {
+				Metrics::Add(METRIC_DISK_CACHE_MISSES);
+				uint64_t params[4] = { png_size, decoded.pixels->xcount, decoded.pixels->ycount, 0 };
+				DiskCache::GetInstance()->Store(DISK_CACHE_ASSET, hash, params,
+					decoded.pixels->data, decoded.pixels->Bytes());
+			}
+		}
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		in_flight.erase(hash);
+		if (decoded.pixels)
+			Insert(hash, png_size, decoded.pixels);
+		return decoded;
+	}).share();
+	in_flight[hash] = result;
+	return result;
+}
+
+// cache_mutex must be held
+void AssetCache::Insert(uint64_t hash, uint64_t png_size, const std::shared_ptr<const ImagePixels>& pixels)
+{
+	if (pixels->MemoryBytes() > budget_bytes)
+		return;
+	auto it = entries.find(hash);
+	if (it != entries.end()) {
+		used_bytes -= it->second->pixels->MemoryBytes();
+		lru.erase(it->second);
+		entries.erase(it);
+	}
+	lru.push_front({ hash, png_size, pixels });
+	entries[hash] = lru.begin();
+	used_bytes += pixels->MemoryBytes();
+	while (used_bytes > budget_bytes) {
+		Entry& last = lru.back();
+		SDHR_LOG_DEBUG("AssetCache: evicting %016llx", (unsigned long long)last.hash);
+		used_bytes -= last.pixels->MemoryBytes();
+		entries.erase(last.hash);
+		lru.pop_back();
+	}
+	Metrics::SetGauge(METRIC_GAUGE_ASSET_CACHE_BYTES, used_bytes);
+}
@@ -0,0 +1,85 @@
+// Apple 2 Super Duper High Resolution
+// Decoded image assets, shared by content
+//
+// Games send the same PNGs again after every reset or level change. The
+// cache is keyed by the XXH64 of the compressed bytes: a hit hands out the
+// already decoded pixels, shared by reference count, instead of decoding
+// again. Decodes of the same bytes that are still in flight are shared too.
+// Entries are evicted least recently used first once the decoded pixels
+// held by the cache go over SDHR_ASSET_CACHE_MB (default 256, 0 disables it).
+// Pixels still used by an asset stay alive after eviction.
+// Below the memory cache, SDHR_CACHE_DIR keeps decoded pixels across restarts.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "DiskCache.h"
+
+// Pixels decoded by stb_image or mapped from the disk cache, released with
+// the last reference. They are 32-bit ARGB like the framebuffer, not stb_image's RGBA.
+// Images with at most 256 colours also get a palette and an index per pixel:
+// the PNG's own palette order for indexed PNGs, else order of first appearance.
+struct ImagePixels {
+	uint8_t* data = NULL;
+	uint64_t xcount = 0;
+	uint64_t ycount = 0;
+	uint64_t key = 0;			// hash of the PNG bytes up to IEND, 0 if unknown
+	DiskCacheMapping mapping;	// set when data is mapped from the disk cache
+	std::vector<uint32_t> palette;	// ARGB, empty if the image has more than 256 colours
+	std::vector<uint8_t> indices;	// palette index of each pixel, empty without a palette
+	uint64_t Bytes() const { return xcount * ycount * 4; }	// of the ARGB data
+	uint64_t MemoryBytes() const { return Bytes() + indices.size() + palette.size() * 4; }
+	ImagePixels() {}
+	ImagePixels(const ImagePixels&) = delete;
+	ImagePixels& operator=(const ImagePixels&) = delete;
+	~ImagePixels();
+};
+
+struct DecodedImage {
+	std::shared_ptr<const ImagePixels> pixels;	// NULL if the decode failed
+	const char* error = NULL;
+};
+
+class AssetCache
+{
+public:
+	// Returns the decoded image of these PNG bytes: ready on a cache hit,
+	// otherwise loaded from the disk cache or decoded on the worker pool.
+	// key receives the content key of the bytes.
+	std::shared_future<DecodedImage> Decode(std::vector<uint8_t>&& png, uint64_t* key);
+
+	// public singleton code
+	static AssetCache* GetInstance()
+	{
+		if (NULL == s_instance)
+			s_instance = new AssetCache();
+		return s_instance;
+	}
+	~AssetCache();
+private:
+	static AssetCache* s_instance;
+	AssetCache();
+
+	struct Entry {
+		uint64_t hash;
+		uint64_t png_size;		// guards against hash collisions between different sizes
+		std::shared_ptr<const ImagePixels> pixels;
+	};
+
+	void Insert(uint64_t hash, uint64_t png_size, const std::shared_ptr<const ImagePixels>& pixels);
+
+	std::mutex cache_mutex;
+	std::list<Entry> lru;		// most recently used first
+	std::unordered_map<uint64_t, std::list<Entry>::iterator> entries;
+	std::unordered_map<uint64_t, std::shared_future<DecodedImage>> in_flight;
+	uint64_t budget_bytes;
+	uint64_t used_bytes;
+	bool build_palettes;	// only needed for indexed tiles, off with SDHR_INDEXED_TILES=0
+};
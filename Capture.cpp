@@ -0,0 +1,175 @@
+#include "Capture.h"
+#include "FrameTiming.h"
+#include "Logger.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// below because "The declaration of a static data member in its class definition is not a definition"
+CaptureWriter* CaptureWriter::s_instance;
+
+//////////////////////////////////////////////////////////////////////////
+// Static helpers
+//////////////////////////////////////////////////////////////////////////
+
+static bool WriteAll(int fd, const uint8_t* data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+void CaptureWriter::FlushAtExit()
+{
+	if (s_instance)
+		s_instance->Flush();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Methods
+//////////////////////////////////////////////////////////////////////////
+
+CaptureWriter::CaptureWriter()
+	: fd(-1), last_us(0), packets(0), used(0)
+{
+}
+
+CaptureWriter::~CaptureWriter()
+{
+	Flush();
+	if (fd >= 0)
+		close(fd);
+}
+
+void CaptureWriter::Initialize()
+{
+	const char* file = getenv("SDHR_RECORD");
+	if (file == NULL || *file == 0 || fd >= 0)
+		return;
+	path = file;
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		SDHR_LOG_ERROR("Cannot open capture file %s: %s", file, strerror(errno));
+		return;
+	}
+	CaptureHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = CAPTURE_VERSION;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header.start_realtime_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	if (!WriteAll(fd, (const uint8_t*)&header, sizeof(header))) {
+		SDHR_LOG_ERROR("Cannot write capture file %s: %s", file, strerror(errno));
+		close(fd);
+		fd = -1;
+		return;
+	}
+	// logging first makes the logger's atexit flush run after ours
+	SDHR_LOG_INFO("Recording bus packets to %s", file);
+	atexit(CaptureWriter::FlushAtExit);
+}
+
+void CaptureWriter::StartSession()
+{
+	if (fd < 0)
+		return;
+	SDHRPacket marker = { CAPTURE_SESSION_ADDR, 0, 0 };
+	Append(marker);
+	Flush();
+}
+
+void CaptureWriter::Append(const SDHRPacket& packet)
+{
+	// a varint is at most 10 bytes
+	if (used + 13 > CAPTURE_BUFFER_SIZE)
+		Flush();
+	uint64_t now_us = FrameTiming::NowNs() / 1000;
+	uint64_t delta = (packets == 0 || now_us < last_us) ? 0 : now_us - last_us;
+	last_us = now_us;
+	++packets;
+	while (delta >= 0x80) {
+		buffer[used++] = (uint8_t)(delta | 0x80);
+		delta >>= 7;
+	}
+	buffer[used++] = (uint8_t)delta;
+	buffer[used++] = packet.addr & 0xff;
+	buffer[used++] = packet.addr >> 8;
+	buffer[used++] = packet.data;
+}
+
+void CaptureWriter::Flush()
+{
+	if (fd < 0 || used == 0)
+		return;
+	if (!WriteAll(fd, buffer, used)) {
+		SDHR_LOG_ERROR("Cannot write capture file %s: %s, recording stopped", path.c_str(), strerror(errno));
+		close(fd);
+		fd = -1;
+	}
+	used = 0;
+}
+
+bool CaptureReader::Load(const char* path)
+{
+	records.clear();
+	sessions = 0;
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) {
+		error = std::string("cannot open ") + path + ": " + strerror(errno);
+		return false;
+	}
+	std::vector<uint8_t> data;
+	uint8_t chunk[65536];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+		data.insert(data.end(), chunk, chunk + n);
+	fclose(f);
+
+	if (data.size() < sizeof(header) || memcmp(data.data(), CAPTURE_MAGIC, 8) != 0) {
+		error = std::string(path) + " is not an SDHR capture";
+		return false;
+	}
+	memcpy(&header, data.data(), sizeof(header));
+	if (header.version < 1 || header.version > CAPTURE_VERSION) {
+		error = std::string(path) + ": unsupported capture version " + std::to_string(header.version);
+		return false;
+	}
+
+	records.reserve((data.size() - sizeof(header)) / 4);
+	size_t p = sizeof(header);
+	uint64_t time_us = 0;
+	while (p < data.size()) {
+		uint64_t delta = 0;
+		int shift = 0;
+		while (p < data.size() && (data[p] & 0x80) && shift < 63) {
+			delta |= (uint64_t)(data[p++] & 0x7f) << shift;
+			shift += 7;
+		}
+		if (p + 4 > data.size())
+			break;	// truncated last record, the server was killed while writing
+		delta |= (uint64_t)data[p++] << shift;
+		time_us += delta;
+		CaptureRecord r;
+		r.time_us = time_us;
+		r.packet.addr = (uint16_t)(data[p] | (data[p + 1] << 8));
+		r.packet.data = data[p + 2];
+		r.packet.pad = 0;
+		p += 3;
+		if (r.packet.addr == CAPTURE_SESSION_ADDR)
+			++sessions;
+		records.push_back(r);
+	}
+	return true;
+}
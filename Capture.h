@@ -0,0 +1,102 @@
+// Apple 2 Super Duper High Resolution
+// Bus packet capture files
+//
+// When SDHR_RECORD is set, the server writes every packet received from the
+// client to that file, with the time elapsed since the previous packet.
+// Records are written out after every SDHR_CTRL_PROCESS, so a server that is
+// killed loses at most the batch it was receiving.
+// SDHRReplay feeds a capture back through the packet decode, ProcessCommands
+// and the renderer, at the original pace or as fast as possible.
+//
+// Format, little endian:
+//   header: "SDHRCAP1", uint32 version, uint32 reserved, uint64 wall clock start (ns since epoch)
+//   records: LEB128 varint of microseconds since the previous record, uint16 addr, uint8 data
+//   A record with addr CAPTURE_SESSION_ADDR marks a client connection (version 2 on).
+// Most packets arrive in bursts, so a record is usually 4 bytes.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "SDHRPacket.h"
+
+#define CAPTURE_MAGIC "SDHRCAP1"
+#define CAPTURE_VERSION 2
+#define CAPTURE_SESSION_ADDR 0xFFFF	// not a bus address
+#define CAPTURE_BUFFER_SIZE 65536
+
+#pragma pack(push, 1)
+struct CaptureHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t start_realtime_ns;
+};
+#pragma pack(pop)
+
+class CaptureWriter
+{
+public:
+	// Opens the SDHR_RECORD file if the variable is set
+	void Initialize();
+	// Called when a client connects
+	void StartSession();
+	// Called from the receive loop for every complete packet
+	void Record(const SDHRPacket& packet) {
+		if (fd < 0)
+			return;
+		Append(packet);
+		if (packet.addr == CXSDHR_CTRL && packet.data == SDHR_CTRL_PROCESS)
+			Flush();
+	}
+	// Writes buffered records, the file is complete after this
+	void Flush();
+	bool IsEnabled() const { return fd >= 0; }
+
+	// public singleton code
+	static CaptureWriter* GetInstance()
+	{
+		if (NULL == s_instance)
+			s_instance = new CaptureWriter();
+		return s_instance;
+	}
+	~CaptureWriter();
+private:
+	static CaptureWriter* s_instance;
+	CaptureWriter();
+	static void FlushAtExit();
+
+	void Append(const SDHRPacket& packet);
+
+	int fd;
+	std::string path;
+	uint64_t last_us;
+	uint64_t packets;
+	size_t used;
+	uint8_t buffer[CAPTURE_BUFFER_SIZE];
+};
+
+struct CaptureRecord {
+	uint64_t time_us;	// since the first packet
+	SDHRPacket packet;	// addr is CAPTURE_SESSION_ADDR for a client connection
+};
+
+// Reads a whole capture in memory
+class CaptureReader
+{
+public:
+	// Returns false and sets error if the file can't be read or isn't a capture
+	bool Load(const char* path);
+	const std::vector<CaptureRecord>& Records() const { return records; }
+	const CaptureHeader& Header() const { return header; }
+	// Client connections recorded, 0 for version 1 captures
+	uint64_t Sessions() const { return sessions; }
+	const std::string& Error() const { return error; }
+private:
+	CaptureHeader header;
+	std::vector<CaptureRecord> records;
+	uint64_t sessions = 0;
+	std::string error;
+};
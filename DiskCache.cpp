@@ -0,0 +1,232 @@
+#include "DiskCache.h"
+#include "Logger.h"
+#include "Trace.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+// below because "The declaration of a static data member in its class definition is not a definition"
+DiskCache* DiskCache::s_instance;
+
+//////////////////////////////////////////////////////////////////////////
+// Static helpers
+//////////////////////////////////////////////////////////////////////////
+
+static bool MakeDirectories(const std::string& path)
+{
+	for (size_t pos = 1; pos <= path.size(); ++pos) {
+		if (pos == path.size() || path[pos] == '/') {
+			std::string sub = path.substr(0, pos);
+			if (mkdir(sub.c_str(), 0755) != 0 && errno != EEXIST)
+				return false;
+		}
+	}
+	return true;
+}
+
+static uint64_t RealtimeNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool HasPrefix(const char* name, const char* prefix)
+{
+	return strncmp(name, prefix, strlen(prefix)) == 0;
+}
+
+// A temporary file left by a writer that is gone, "<name>.raw.tmp<pid>.<thread>"
+static bool IsOrphanedTemporary(const char* name)
+{
+	const char* tmp = strstr(name, ".raw.tmp");
+	if (tmp == NULL)
+		return false;
+	long pid = strtol(tmp + 8, NULL, 10);
+	return pid > 0 && kill((pid_t)pid, 0) != 0 && errno == ESRCH;
+}
+
+void DiskCacheMapping::Unmap()
+{
+	if (base)
+		munmap(base, size);
+	base = NULL;
+	size = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Methods
+//////////////////////////////////////////////////////////////////////////
+
+void DiskCache::Initialize()
+{
+	const char* env = getenv("SDHR_CACHE_DIR");
+	if (env == NULL || *env == 0 || IsEnabled())
+		return;
+	if (!MakeDirectories(env)) {
+		SDHR_LOG_ERROR("Cannot create cache directory %s: %s", env, strerror(errno));
+		return;
+	}
+	dir = env;
+	const char* mb = getenv("SDHR_CACHE_DIR_MB");
+	if (mb && *mb)
+		budget_bytes = (uint64_t)atoll(mb) << 20;
+	ScanDirectory();
+	SDHR_LOG_INFO("Caching decoded assets and tilesets in %s, %llu MB in %zu files",
+		env, (unsigned long long)(files_bytes >> 20), files.size());
+	Evict(std::string());
+}
+
+void DiskCache::ScanDirectory()
+{
+	DIR* d = opendir(dir.c_str());
+	if (d == NULL)
+		return;
+	std::lock_guard<std::mutex> lock(files_mutex);
+	while (struct dirent* e = readdir(d)) {
+		if (!HasPrefix(e->d_name, "asset-") && !HasPrefix(e->d_name, "tileset-"))
+			continue;
+		std::string path = dir + "/" + e->d_name;
+		if (IsOrphanedTemporary(e->d_name)) {
+			unlink(path.c_str());
+			continue;
+		}
+		size_t len = strlen(e->d_name);
+		if (len < 4 || strcmp(e->d_name + len - 4, ".raw") != 0)
+			continue;
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		uint64_t mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+		files[path] = { (uint64_t)st.st_size, mtime };
+		files_bytes += st.st_size;
+	}
+	closedir(d);
+}
+
+void DiskCache::MarkUsed(const std::string& path, uint64_t bytes)
+{
+	std::lock_guard<std::mutex> lock(files_mutex);
+	CacheFile& f = files[path];
+	files_bytes += bytes - f.bytes;
+	f.bytes = bytes;
+	f.last_used = RealtimeNs();
+}
+
+// Deletes the least recently used files until the directory fits its budget
+void DiskCache::Evict(const std::string& keep)
+{
+	if (budget_bytes == 0)
+		return;
+	std::lock_guard<std::mutex> lock(files_mutex);
+	if (files_bytes <= budget_bytes)
+		return;
+	std::vector<std::pair<uint64_t, std::string>> by_age;
+	by_age.reserve(files.size());
+	for (auto& it : files)
+		by_age.emplace_back(it.second.last_used, it.first);
+	std::sort(by_age.begin(), by_age.end());
+	for (auto& it : by_age) {
+		if (files_bytes <= budget_bytes)
+			break;
+		if (it.second == keep)
+			continue;
+		// a mapping of the file stays valid after the unlink
+		if (unlink(it.second.c_str()) != 0 && errno != ENOENT) {
+			SDHR_LOG_WARN("Cannot remove cache file %s: %s", it.second.c_str(), strerror(errno));
+			continue;
+		}
+		SDHR_LOG_DEBUG("DiskCache: evicted %s", it.second.c_str());
+		files_bytes -= files[it.second].bytes;
+		files.erase(it.second);
+	}
+}
+
+std::string DiskCache::PathFor(DiskCacheKind_e kind, uint64_t key) const
+{
+	char name[64];
+	snprintf(name, sizeof(name), "/%s-%016llx.raw", kind == DISK_CACHE_ASSET ? "asset" : "tileset",
+		(unsigned long long)key);
+	return dir + name;
+}
+
+bool DiskCache::Load(DiskCacheKind_e kind, uint64_t key, DiskCacheMapping& mapping)
+{
+	if (!IsEnabled())
+		return false;
+	SDHR_TRACE_SCOPE("disk_cache_load", "kind", kind);
+	std::string path = PathFor(kind, key);
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	void* base = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= DISK_CACHE_HEADER_SIZE)
+		base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	// the mtime keeps the use order across restarts
+	if (base != MAP_FAILED)
+		futimens(fd, NULL);
+	close(fd);
+	if (base == MAP_FAILED)
+		return false;
+	mapping.base = base;
+	mapping.size = st.st_size;
+	const DiskCacheHeader* h = mapping.Header();
+	if (memcmp(h->magic, DISK_CACHE_MAGIC, 8) != 0 || h->kind != (uint32_t)kind || h->format != DISK_CACHE_FORMAT
+		|| h->key != key || DISK_CACHE_HEADER_SIZE + h->data_bytes > mapping.size) {
+		SDHR_LOG_WARN("Ignoring stale or damaged cache file %s", path.c_str());
+		mapping.Unmap();
+		return false;
+	}
+	MarkUsed(path, mapping.size);
+	SDHR_LOG_DEBUG("DiskCache: mapped %s", path.c_str());
+	return true;
+}
+
+void DiskCache::Store(DiskCacheKind_e kind, uint64_t key, const uint64_t params[4], const void* data, uint64_t data_bytes)
+{
+	if (!IsEnabled())
+		return;
+	SDHR_TRACE_SCOPE("disk_cache_store", "kind", kind, "bytes", (int64_t)data_bytes);
+	std::string path = PathFor(kind, key);
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".tmp%d.%lx", getpid(), (unsigned long)pthread_self());
+	std::string tmp_path = path + suffix;
+
+	uint8_t header_page[DISK_CACHE_HEADER_SIZE];
+	memset(header_page, 0, sizeof(header_page));
+	DiskCacheHeader* h = (DiskCacheHeader*)header_page;
+	memcpy(h->magic, DISK_CACHE_MAGIC, 8);
+	h->kind = kind;
+	h->format = DISK_CACHE_FORMAT;
+	h->key = key;
+	memcpy(h->params, params, sizeof(h->params));
+	h->data_bytes = data_bytes;
+
+	FILE* f = fopen(tmp_path.c_str(), "wb");
+	bool ok = (f != NULL);
+	if (ok) {
+		ok = fwrite(header_page, 1, sizeof(header_page), f) == sizeof(header_page)
+			&& fwrite(data, 1, data_bytes, f) == data_bytes;
+		ok = (fclose(f) == 0) && ok;
+	}
+	if (ok)
+		ok = (rename(tmp_path.c_str(), path.c_str()) == 0);
+	if (!ok) {
+		SDHR_LOG_WARN("Cannot write cache file %s: %s", path.c_str(), strerror(errno));
+		unlink(tmp_path.c_str());
+		return;
+	}
+	MarkUsed(path, DISK_CACHE_HEADER_SIZE + data_bytes);
+	Evict(path);
+}
@@ -0,0 +1,92 @@
+// Apple 2 Super Duper High Resolution
+// On-disk cache of decoded assets and extracted tilesets
+//
+// When SDHR_CACHE_DIR is set, decoded image pixels and extracted tile data
+// are written there, keyed by a hash of what they were made from (the PNG
+// bytes, or the asset and the tile offsets). After a restart they are mapped
+// read-only from the file instead of being decoded and extracted again.
+// Each file is a one page header followed by the raw data, so the data
+// is page aligned. Files are written by the worker threads, to a temporary
+// name first, so a reader never sees half a file.
+// The directory is kept under SDHR_CACHE_DIR_MB: after a store, the least
+// recently used files are deleted until it fits again. Loading a file counts
+// as a use, and files from earlier runs are picked up at startup.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <mutex>
+#include <unordered_map>
+
+#define DISK_CACHE_MAGIC "SDHRDC01"
+#define DISK_CACHE_HEADER_SIZE 4096
+// Bump whenever the layout of cached pixels or tiles changes
+#define DISK_CACHE_FORMAT 4
+
+enum DiskCacheKind_e {
+	DISK_CACHE_ASSET = 1,		// ARGB pixels, params: png size, xcount, ycount
+	DISK_CACHE_TILESET = 2,		// tiles, tile_map, palette if indexed, params: xdim, ydim, num_entries,
+								// num_bitmaps | (indexed << 32)
+};
+
+struct DiskCacheHeader {
+	char magic[8];
+	uint32_t kind;
+	uint32_t format;
+	uint64_t key;
+	uint64_t params[4];
+	uint64_t data_bytes;
+};
+
+// A read-only mapping of a cache file
+struct DiskCacheMapping {
+	void* base = NULL;
+	size_t size = 0;
+	const DiskCacheHeader* Header() const { return (const DiskCacheHeader*)base; }
+	uint8_t* Data() const { return (uint8_t*)base + DISK_CACHE_HEADER_SIZE; }
+	void Unmap();
+};
+
+class DiskCache
+{
+public:
+	// Reads SDHR_CACHE_DIR and SDHR_CACHE_DIR_MB, creates the directory and
+	// indexes the files already in it
+	void Initialize();
+	bool IsEnabled() const { return !dir.empty(); }
+
+	// Maps the entry, false on a miss or a file that doesn't match
+	bool Load(DiskCacheKind_e kind, uint64_t key, DiskCacheMapping& mapping);
+	// Writes the entry, errors are logged and otherwise ignored
+	void Store(DiskCacheKind_e kind, uint64_t key, const uint64_t params[4], const void* data, uint64_t data_bytes);
+
+	// public singleton code
+	static DiskCache* GetInstance()
+	{
+		if (NULL == s_instance)
+			s_instance = new DiskCache();
+		return s_instance;
+	}
+	~DiskCache() {}
+private:
+	static DiskCache* s_instance;
+	DiskCache() {}
+
+	std::string PathFor(DiskCacheKind_e kind, uint64_t key) const;
+	void ScanDirectory();
+	void MarkUsed(const std::string& path, uint64_t bytes);
+	void Evict(const std::string& keep);
+
+	struct CacheFile {
+		uint64_t bytes;
+		uint64_t last_used;		// realtime ns, the file's mtime for files from earlier runs
+	};
+
+	std::string dir;
+	uint64_t budget_bytes = 1024ull << 20;	// 0 is no limit
+	std::mutex files_mutex;
+	std::unordered_map<std::string, CacheFile> files;	// by path
+	uint64_t files_bytes = 0;
+};
@@ -22,6 +22,9 @@
   */
 #include "DrawVBlank.h"
 #include "SDHRManager.h"
+#include "FrameTiming.h"
+#include "Trace.h"
+#include "Metrics.h"
 
 struct modeset_dev* modeset_list = NULL;
 int modeset_fd;
@@ -420,6 +423,7 @@ void modeset_page_flip_event(int fd, unsigned int frame,
 {
 	struct modeset_dev* dev = (modeset_dev*)data;
 
+	FrameTiming::GetInstance()->MarkFlipEvent(frame, sec, usec);
 	dev->pflip_pending = false;
 	if (!dev->cleanup)
 		modeset_draw_dev(fd, dev);
@@ -568,15 +572,22 @@ void modeset_draw_dev(int fd, struct modeset_dev* dev)
 	buf = &dev->bufs[dev->front_buf ^ 1];
 
 	// Draw based on all the internal structs in SDHRManager
+	FrameTiming::GetInstance()->MarkStage(FRAME_STAGE_RENDER_START);
 	SDHRManager::GetInstance()->DrawWindowsIntoBuffer(buf);
+	FrameTiming::GetInstance()->MarkStage(FRAME_STAGE_RENDER_END);
+	Metrics::Add(METRIC_FRAMES_RENDERED);
 
-	ret = drmModePageFlip(fd, dev->crtc, buf->fb,
-		DRM_MODE_PAGE_FLIP_EVENT, dev);
+	{
+		SDHR_TRACE_SCOPE("drmModePageFlip");
+		ret = drmModePageFlip(fd, dev->crtc, buf->fb,
+			DRM_MODE_PAGE_FLIP_EVENT, dev);
+	}
 	if (ret) {
 		fprintf(stderr, "cannot flip CRTC for connector %u (%d): %m\n",
 			dev->conn, errno);
 	}
 	else {
+		FrameTiming::GetInstance()->MarkStage(FRAME_STAGE_FLIP_SUBMIT);
 		dev->front_buf ^= 1;
 		dev->pflip_pending = true;
 	}
@@ -0,0 +1,177 @@
+#include "FrameTiming.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cstdlib>
+#include "Logger.h"
+#include "Trace.h"
+
+// below because "The declaration of a static data member in its class definition is not a definition"
+FrameTiming* FrameTiming::s_instance;
+
+//////////////////////////////////////////////////////////////////////////
+// Static helpers
+//////////////////////////////////////////////////////////////////////////
+
+// Single writer: a load and a store is enough, no need for a locked RMW
+static inline void bump(std::atomic<uint64_t>& a, uint64_t v)
+{
+	a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+uint64_t FrameTiming::NowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Methods
+//////////////////////////////////////////////////////////////////////////
+
+FrameTiming::FrameTiming()
+	: shared(NULL), shared_is_shm(false)
+	, current(), pending()
+	, has_pending(false), has_last_vblank(false)
+	, last_vblank_seq(0), next_frame_id(0), batch_start_ns(0)
+{
+	// Private until MapSharedMemory(), so tools that drive SDHRManager
+	// don't clobber the segment of a running server
+	shared = (FrameTimingShared*)calloc(1, sizeof(FrameTimingShared));
+	shared->ring_size = FRAMETIMING_RING_SIZE;
+	shared->histogram_buckets = FRAMETIMING_HISTOGRAM_BUCKETS;
+	shared->magic = FRAMETIMING_MAGIC;
+}
+
+void FrameTiming::MapSharedMemory()
+{
+	if (shared_is_shm)
+		return;
+	// Put the ring in shared memory so SDHRFrameDump can read it.
+	// If that isn't possible, keep instrumenting into private memory.
+	FrameTimingShared* shm = NULL;
+	int fd = shm_open(FRAMETIMING_SHM_NAME, O_CREAT | O_RDWR, 0644);
+	if (fd >= 0) {
+		if (ftruncate(fd, sizeof(FrameTimingShared)) == 0) {
+			void* p = mmap(NULL, sizeof(FrameTimingShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED)
+				shm = (FrameTimingShared*)p;
+		}
+		close(fd);
+	}
+	if (shm == NULL) {
+		SDHR_LOG_WARN("FrameTiming: cannot map shared memory %s, timings are not visible to SDHRFrameDump",
+			FRAMETIMING_SHM_NAME);
+		return;
+	}
+	// a previous server run may have left its data in the segment
+	shm->magic = 0;
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy((void*)shm, shared, sizeof(FrameTimingShared));
+	free(shared);
+	shared = shm;
+	shared_is_shm = true;
+}
+
+FrameTiming::~FrameTiming()
+{
+	if (shared_is_shm) {
+		munmap(shared, sizeof(FrameTimingShared));
+		shm_unlink(FRAMETIMING_SHM_NAME);
+	}
+	else {
+		free(shared);
+	}
+}
+
+void FrameTiming::MarkStage(FrameStage_e stage)
+{
+	uint64_t now = NowNs();
+	switch (stage) {
+	case FRAME_STAGE_PACKET_RECEIVED:
+		// The queue span starts at the batch's first packet, not at its PROCESS
+		if (batch_start_ns)
+			now = batch_start_ns;
+		batch_start_ns = 0;
+		// If the previous batch never made it to a frame (SDHR disabled, processing failed)
+		// its commands show up in the next frame, so latency is measured from the oldest batch.
+		if (current.stamp_ns[FRAME_STAGE_PACKET_RECEIVED] == 0)
+			current.stamp_ns[FRAME_STAGE_PACKET_RECEIVED] = now;
+		else
+			bump(shared->batches_coalesced, 1);
+		++current.batches;
+		break;
+	case FRAME_STAGE_FLIP_SUBMIT:
+		current.stamp_ns[FRAME_STAGE_FLIP_SUBMIT] = now;
+		current.frame_id = next_frame_id++;
+		pending = current;
+		has_pending = true;
+		current = {};
+		break;
+	case FRAME_STAGE_FLIP_EVENT:
+		// needs the kernel timestamp, see MarkFlipEvent()
+		break;
+	default:
+		current.stamp_ns[stage] = now;
+		break;
+	}
+}
+
+void FrameTiming::MarkFlipEvent(unsigned int vblank_seq, unsigned int sec, unsigned int usec)
+{
+	if (!has_pending)
+		return;
+	// DRM event timestamps are CLOCK_MONOTONIC
+	pending.stamp_ns[FRAME_STAGE_FLIP_EVENT] = (uint64_t)sec * 1000000000ull + (uint64_t)usec * 1000;
+	pending.vblank_seq = vblank_seq;
+	pending.missed_vblanks = 0;
+	if (has_last_vblank && vblank_seq > last_vblank_seq + 1)
+		pending.missed_vblanks = vblank_seq - last_vblank_seq - 1;
+	has_last_vblank = true;
+	last_vblank_seq = vblank_seq;
+	has_pending = false;
+	if (Tracer::IsEnabled())
+		Tracer::GetInstance()->RecordSpan("drm_flip", pending.stamp_ns[FRAME_STAGE_FLIP_SUBMIT],
+			pending.stamp_ns[FRAME_STAGE_FLIP_EVENT], "vblank", vblank_seq, "frame", (int64_t)pending.frame_id);
+	CompleteFrame(&pending);
+}
+
+void FrameTiming::Observe(FrameSpan_e span, const FrameTimingRecord* record, FrameStage_e from, FrameStage_e to)
+{
+	uint64_t t0 = record->stamp_ns[from];
+	uint64_t t1 = record->stamp_ns[to];
+	if (t0 == 0 || t1 == 0 || t1 < t0)
+		return;
+	uint64_t us = (t1 - t0) / 1000;
+	FrameTimingHistogram* h = &shared->histograms[span];
+	bump(h->buckets[FrameTimingBucket(us)], 1);
+	bump(h->sum_us, us);
+	if (us > h->max_us.load(std::memory_order_relaxed))
+		h->max_us.store(us, std::memory_order_relaxed);
+	bump(h->count, 1);
+}
+
+void FrameTiming::CompleteFrame(FrameTimingRecord* record)
+{
+	Observe(FRAME_SPAN_QUEUE, record, FRAME_STAGE_PACKET_RECEIVED, FRAME_STAGE_PROCESS_START);
+	Observe(FRAME_SPAN_PROCESS, record, FRAME_STAGE_PROCESS_START, FRAME_STAGE_PROCESS_END);
+	Observe(FRAME_SPAN_WAIT_FLIP, record, FRAME_STAGE_PROCESS_END, FRAME_STAGE_RENDER_START);
+	Observe(FRAME_SPAN_RENDER, record, FRAME_STAGE_RENDER_START, FRAME_STAGE_RENDER_END);
+	Observe(FRAME_SPAN_SUBMIT, record, FRAME_STAGE_RENDER_END, FRAME_STAGE_FLIP_SUBMIT);
+	Observe(FRAME_SPAN_SCANOUT, record, FRAME_STAGE_FLIP_SUBMIT, FRAME_STAGE_FLIP_EVENT);
+	Observe(FRAME_SPAN_TOTAL, record, FRAME_STAGE_PACKET_RECEIVED, FRAME_STAGE_FLIP_EVENT);
+	bump(shared->frames_flipped, 1);
+	bump(shared->missed_vblanks, record->missed_vblanks);
+
+	// seqlock write of the ring slot
+	uint64_t index = shared->head.load(std::memory_order_relaxed);
+	FrameTimingShared::Slot* slot = &shared->ring[index & (FRAMETIMING_RING_SIZE - 1)];
+	slot->seq.store(2 * index + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(&slot->record, record, sizeof(*record));
+	slot->seq.store(2 * (index + 1), std::memory_order_release);
+	shared->head.store(index + 1, std::memory_order_release);
+}
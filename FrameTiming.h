@@ -0,0 +1,192 @@
+// Apple 2 Super Duper High Resolution
+// Frame pacing and latency instrumentation
+//
+// Every frame is timestamped from the SDHR_CTRL_PROCESS packet that made it
+// up to the page flip event that put it on screen. Completed frames are pushed
+// into a lock-free ring that lives in POSIX shared memory, together with
+// per-stage histograms and counters, so that an external tool (SDHRFrameDump)
+// can read them while the server is running.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <algorithm>
+
+#define FRAMETIMING_SHM_NAME "/sdhrserver_frametiming"
+#define FRAMETIMING_MAGIC 0x3154464452485453ull	// "STHRDFT1"
+#define FRAMETIMING_RING_SIZE 1024				// must be a power of 2
+#define FRAMETIMING_BUCKETS_PER_OCTAVE 4
+#define FRAMETIMING_HISTOGRAM_BUCKETS 80		// 20 octaves: 1us to ~1s
+
+enum FrameStage_e {
+	FRAME_STAGE_PACKET_RECEIVED = 0,	// first packet of the batch received
+	FRAME_STAGE_PROCESS_START,			// ProcessCommands() entered
+	FRAME_STAGE_PROCESS_END,			// ProcessCommands() returned
+	FRAME_STAGE_RENDER_START,			// DrawWindowsIntoBuffer() entered
+	FRAME_STAGE_RENDER_END,				// DrawWindowsIntoBuffer() returned
+	FRAME_STAGE_FLIP_SUBMIT,			// drmModePageFlip() accepted the buffer
+	FRAME_STAGE_FLIP_EVENT,				// kernel reported the flip (vblank time)
+	FRAME_STAGE_COUNT
+};
+
+// Spans between two stages, each one has its own histogram
+enum FrameSpan_e {
+	FRAME_SPAN_QUEUE = 0,		// packet received -> process start
+	FRAME_SPAN_PROCESS,			// process start -> process end
+	FRAME_SPAN_WAIT_FLIP,		// process end -> render start (waiting for the previous flip)
+	FRAME_SPAN_RENDER,			// render start -> render end
+	FRAME_SPAN_SUBMIT,			// render end -> flip submit
+	FRAME_SPAN_SCANOUT,			// flip submit -> flip event
+	FRAME_SPAN_TOTAL,			// packet received -> flip event
+	FRAME_SPAN_COUNT
+};
+
+static const char* const FrameSpanNames[FRAME_SPAN_COUNT] = {
+	"queue", "process", "wait_flip", "render", "submit", "scanout", "total"
+};
+
+struct FrameTimingRecord {
+	uint64_t frame_id;
+	uint64_t stamp_ns[FRAME_STAGE_COUNT];	// CLOCK_MONOTONIC, 0 if the stage didn't happen
+	uint32_t vblank_seq;					// DRM frame counter of the flip event
+	uint32_t missed_vblanks;				// vblanks that went by without a new frame before this one
+	uint32_t batches;						// PROCESS batches folded into this frame
+	uint32_t pad;
+};
+
+// Log-linear histogram of microsecond values, single writer
+struct FrameTimingHistogram {
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sum_us;
+	std::atomic<uint64_t> max_us;
+	std::atomic<uint64_t> buckets[FRAMETIMING_HISTOGRAM_BUCKETS];
+};
+
+// Layout of the shared memory segment. There is a single writer (the server's
+// main thread) so every update is a plain relaxed store, readers never block it.
+// Each ring slot is protected by a sequence number: odd while being written,
+// 2 * (index + 1) once record number <index> is complete.
+struct FrameTimingShared {
+	uint64_t magic;
+	uint32_t ring_size;
+	uint32_t histogram_buckets;
+	std::atomic<uint64_t> head;				// number of records ever pushed
+	std::atomic<uint64_t> frames_flipped;
+	std::atomic<uint64_t> batches_coalesced;	// PROCESS batches that didn't get their own frame
+	std::atomic<uint64_t> missed_vblanks;
+	struct Slot {
+		std::atomic<uint64_t> seq;
+		FrameTimingRecord record;
+	} ring[FRAMETIMING_RING_SIZE];
+	FrameTimingHistogram histograms[FRAME_SPAN_COUNT];
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Reader helpers, shared by the server and the dump tool
+//////////////////////////////////////////////////////////////////////////
+
+inline uint32_t FrameTimingBucket(uint64_t us)
+{
+	if (us < FRAMETIMING_BUCKETS_PER_OCTAVE)
+		return (uint32_t)us;
+	uint32_t msb = 63 - __builtin_clzll(us);
+	// the 2 bits below the msb select the sub-bucket within the octave
+	uint32_t sub = (uint32_t)(us >> (msb - 2)) & (FRAMETIMING_BUCKETS_PER_OCTAVE - 1);
+	uint32_t bucket = (msb - 1) * FRAMETIMING_BUCKETS_PER_OCTAVE + sub;
+	return bucket < FRAMETIMING_HISTOGRAM_BUCKETS ? bucket : FRAMETIMING_HISTOGRAM_BUCKETS - 1;
+}
+
+// Upper bound (exclusive) in microseconds of the given bucket
+inline uint64_t FrameTimingBucketLimit(uint32_t bucket)
+{
+	if (bucket < FRAMETIMING_BUCKETS_PER_OCTAVE)
+		return bucket + 1;
+	uint32_t msb = bucket / FRAMETIMING_BUCKETS_PER_OCTAVE + 1;
+	uint64_t sub = bucket % FRAMETIMING_BUCKETS_PER_OCTAVE;
+	return ((uint64_t)FRAMETIMING_BUCKETS_PER_OCTAVE + sub + 1) << (msb - 2);
+}
+
+// Returns the upper bound of the bucket holding the q-th quantile (0 < q <= 1)
+inline uint64_t FrameTimingPercentile(const FrameTimingHistogram& h, double q)
+{
+	uint64_t count = h.count.load(std::memory_order_relaxed);
+	if (count == 0)
+		return 0;
+	uint64_t target = (uint64_t)(q * count + 0.5);
+	if (target == 0)
+		target = 1;
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < FRAMETIMING_HISTOGRAM_BUCKETS; ++i) {
+		seen += h.buckets[i].load(std::memory_order_relaxed);
+		if (seen >= target)
+			return std::min(FrameTimingBucketLimit(i), h.max_us.load(std::memory_order_relaxed));
+	}
+	return h.max_us.load(std::memory_order_relaxed);
+}
+
+// Copies record number <index> out of the ring.
+// Returns false if it was overwritten or is being written.
+inline bool FrameTimingReadRecord(const FrameTimingShared* shared, uint64_t index, FrameTimingRecord* out)
+{
+	const FrameTimingShared::Slot* slot = &shared->ring[index & (FRAMETIMING_RING_SIZE - 1)];
+	uint64_t expected = 2 * (index + 1);
+	if (slot->seq.load(std::memory_order_acquire) != expected)
+		return false;
+	memcpy(out, &slot->record, sizeof(*out));
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return slot->seq.load(std::memory_order_relaxed) == expected;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Writer
+//////////////////////////////////////////////////////////////////////////
+
+class FrameTiming
+{
+public:
+	// Moves the ring into shared memory for SDHRFrameDump. Only the server does this.
+	void MapSharedMemory();
+	void MarkStage(FrameStage_e stage);
+	// Called for every packet, remembers when the current batch started
+	void MarkBatchPacket() {
+		if (batch_start_ns == 0)
+			batch_start_ns = NowNs();
+	}
+	// Called from the DRM page flip handler with the kernel's vblank timestamp
+	void MarkFlipEvent(unsigned int vblank_seq, unsigned int sec, unsigned int usec);
+
+	const FrameTimingShared* GetShared() const {
+		return shared;
+	}
+
+	static uint64_t NowNs();
+
+	// public singleton code
+	static FrameTiming* GetInstance()
+	{
+		if (NULL == s_instance)
+			s_instance = new FrameTiming();
+		return s_instance;
+	}
+	~FrameTiming();
+private:
+	static FrameTiming* s_instance;
+	FrameTiming();
+
+	void CompleteFrame(FrameTimingRecord* record);
+	void Observe(FrameSpan_e span, const FrameTimingRecord* record, FrameStage_e from, FrameStage_e to);
+
+	FrameTimingShared* shared;
+	bool shared_is_shm;
+
+	FrameTimingRecord current;	// frame being built from PROCESS batches
+	FrameTimingRecord pending;	// frame submitted for flip, waiting for its flip event
+	bool has_pending;
+	bool has_last_vblank;
+	uint32_t last_vblank_seq;
+	uint64_t next_frame_id;
+	uint64_t batch_start_ns;	// first packet since the last PROCESS, 0 if none yet
+};
@@ -0,0 +1,36 @@
+// Apple 2 Super Duper High Resolution
+// Framebuffers in plain memory, to run the renderer without DRM
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include "DrawVBlank.h"
+#include "MappedRegion.h"
+
+struct HeadlessFramebuffer {
+	modeset_buf buf;
+	MappedRegion pixels;	// may get huge pages, unlike the DRM dumb buffers
+
+	HeadlessFramebuffer(uint32_t width, uint32_t height)
+	{
+		memset(&buf, 0, sizeof(buf));
+		buf.width = width;
+		buf.height = height;
+		buf.stride = width * sizeof(uint32_t);
+		buf.size = buf.stride * height;
+		if (!pixels.Map(buf.size, METRIC_REGION_SURFACE))
+			throw std::bad_alloc();
+		buf.map = pixels.base;
+	}
+	~HeadlessFramebuffer() {
+		pixels.Unmap();
+	}
+	HeadlessFramebuffer(const HeadlessFramebuffer&) = delete;
+	HeadlessFramebuffer& operator=(const HeadlessFramebuffer&) = delete;
+
+	void Clear() {
+		memset(buf.map, 0, buf.size);
+	}
+};
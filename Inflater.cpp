@@ -0,0 +1,97 @@
+#include "Inflater.h"
+#include "Trace.h"
+#include <zlib.h>
+#include <cstring>
+#if SDHR_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// Methods
+//////////////////////////////////////////////////////////////////////////
+
+#if SDHR_USE_LIBDEFLATE
+
+Inflater::Inflater()
+	: decompressor(libdeflate_alloc_decompressor())
+{
+}
+
+Inflater::~Inflater()
+{
+	if (decompressor)
+		libdeflate_free_decompressor(decompressor);
+}
+
+const char* Inflater::Implementation()
+{
+	return "libdeflate";
+}
+
+int Inflater::Inflate(const uint8_t* source, uint64_t size, uint8_t* dest, uint64_t capacity, uint64_t* dest_size)
+{
+	SDHR_TRACE_SCOPE("inflate", "bytes", (int64_t)size);
+	*dest_size = 0;
+	if (decompressor == NULL)
+		return Z_MEM_ERROR;
+	// the _ex calls accept trailing bytes after the stream, like the rest of the upload region
+	size_t in_bytes = 0;
+	size_t out_bytes = 0;
+	libdeflate_result ret;
+	if (size >= 2 && source[0] == 0x1f && source[1] == 0x8b)
+		ret = libdeflate_gzip_decompress_ex(decompressor, source, size, dest, capacity, &in_bytes, &out_bytes);
+	else
+		ret = libdeflate_zlib_decompress_ex(decompressor, source, size, dest, capacity, &in_bytes, &out_bytes);
+	switch (ret) {
+	case LIBDEFLATE_SUCCESS:
+		*dest_size = out_bytes;
+		return Z_OK;
+	case LIBDEFLATE_INSUFFICIENT_SPACE:
+		// libdeflate leaves dest undefined when it runs out of space, nothing in it can be used
+	default:
+		return Z_DATA_ERROR;
+	}
+}
+
+#else
+
+Inflater::Inflater()
+	: initialized(false)
+{
+	memset(&strm, 0, sizeof(strm));
+	// zlib or gzip, detected from the header
+	initialized = (inflateInit2(&strm, 15 + 32) == Z_OK);
+}
+
+Inflater::~Inflater()
+{
+	if (initialized)
+		(void)inflateEnd(&strm);
+}
+
+const char* Inflater::Implementation()
+{
+	return "zlib";
+}
+
+int Inflater::Inflate(const uint8_t* source, uint64_t size, uint8_t* dest, uint64_t capacity, uint64_t* dest_size)
+{
+	SDHR_TRACE_SCOPE("inflate", "bytes", (int64_t)size);
+	*dest_size = 0;
+	if (!initialized)
+		return Z_MEM_ERROR;
+	inflateReset(&strm);
+	strm.next_in = (Bytef*)source;
+	strm.avail_in = (uInt)size;
+	strm.next_out = dest;
+	strm.avail_out = (uInt)capacity;
+	int ret = inflate(&strm, Z_FINISH);
+	*dest_size = strm.total_out;
+	if (ret == Z_STREAM_END)
+		return Z_OK;
+	if (ret == Z_BUF_ERROR && strm.avail_out == 0)
+		return Z_BUF_ERROR;		// more output than capacity
+	return Z_DATA_ERROR;
+}
+
+#endif
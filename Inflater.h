@@ -0,0 +1,41 @@
+// Apple 2 Super Duper High Resolution
+// Decompression of uploaded zlib and gzip data
+//
+// The source is already contiguous in the uploaded data region and the size
+// of the result is usually known, so an Inflater decodes in one call straight
+// into the destination. It keeps its decompressor state between calls
+// (inflateReset instead of inflateInit2/inflateEnd). Configure with
+// -DSDHR_USE_LIBDEFLATE=ON to use libdeflate instead of zlib.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#if SDHR_USE_LIBDEFLATE
+struct libdeflate_decompressor;
+#else
+#include <zlib.h>
+#endif
+
+class Inflater
+{
+public:
+	// Inflates zlib or gzip data from source into dest.
+	// Returns Z_OK, Z_BUF_ERROR when the output doesn't fit in capacity, or Z_DATA_ERROR.
+	// dest_size gets the number of bytes written, capacity if they didn't fit.
+	// libdeflate doesn't keep the output that fits, so there it's Z_DATA_ERROR and 0.
+	int Inflate(const uint8_t* source, uint64_t size, uint8_t* dest, uint64_t capacity, uint64_t* dest_size);
+	static const char* Implementation();
+
+	Inflater();
+	~Inflater();
+	Inflater(const Inflater&) = delete;
+	Inflater& operator=(const Inflater&) = delete;
+private:
+#if SDHR_USE_LIBDEFLATE
+	libdeflate_decompressor* decompressor;
+#else
+	z_stream strm;
+	bool initialized;
+#endif
+};
@@ -0,0 +1,142 @@
+#include "Logger.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+#include <strings.h>
+#include <algorithm>
+#include <chrono>
+
+// below because "The declaration of a static data member in its class definition is not a definition"
+Logger* Logger::s_instance;
+std::atomic<int> Logger::s_runtime_level(LOG_LEVEL_INFO);
+
+//////////////////////////////////////////////////////////////////////////
+// Static helpers
+//////////////////////////////////////////////////////////////////////////
+
+static LogLevel_e ParseLevel(const char* s, LogLevel_e fallback)
+{
+	static const char* const names[] = { "trace", "debug", "info", "warn", "error", "none" };
+	for (int i = LOG_LEVEL_TRACE; i <= LOG_LEVEL_NONE; ++i) {
+		if (strcasecmp(s, names[i]) == 0)
+			return (LogLevel_e)i;
+	}
+	return fallback;
+}
+
+void Logger::FlushAtExit()
+{
+	if (s_instance)
+		s_instance->Flush();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Methods
+//////////////////////////////////////////////////////////////////////////
+
+Logger::Logger()
+	: running(true)
+{
+	const char* level = getenv("SDHR_LOG_LEVEL");
+	if (level)
+		SetLevel(ParseLevel(level, LOG_LEVEL_INFO));
+	drain_thread = std::thread(&Logger::DrainThread, this);
+	atexit(Logger::FlushAtExit);
+}
+
+Logger::~Logger()
+{
+	running.store(false);
+	if (drain_thread.joinable())
+		drain_thread.join();
+	Flush();
+	for (LogRing* ring : rings)
+		delete ring;
+}
+
+Logger::LogRing* Logger::GetThreadRing()
+{
+	// Rings are never freed while the logger lives, so a thread that exits
+	// leaves its unread messages behind for the drainer
+	thread_local LogRing* ring = NULL;
+	if (ring == NULL) {
+		ring = new LogRing();
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		rings.push_back(ring);
+	}
+	return ring;
+}
+
+void Logger::Log(LogLevel_e level, const char* format, ...)
+{
+	LogRing* ring = GetThreadRing();
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	if (head - ring->tail.load(std::memory_order_acquire) >= LOGGER_RING_SIZE) {
+		// full, never wait for the drainer
+		ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+	LogRecord* r = &ring->records[head & (LOGGER_RING_SIZE - 1)];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(r->text, sizeof(r->text), format, args);
+	va_end(args);
+	if (len < 0)
+		len = 0;
+	r->length = (uint16_t)std::min(len, LOGGER_RECORD_TEXT - 1);
+	r->level = (uint8_t)level;
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+bool Logger::Drain()
+{
+	std::lock_guard<std::mutex> drain_lock(drain_mutex);
+	std::vector<LogRing*> snapshot;
+	{
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		snapshot = rings;
+	}
+	bool wrote_out = false;
+	bool wrote_err = false;
+	for (LogRing* ring : snapshot) {
+		uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+		for (; tail != head; ++tail) {
+			LogRecord* r = &ring->records[tail & (LOGGER_RING_SIZE - 1)];
+			FILE* out = (r->level >= LOG_LEVEL_WARN) ? stderr : stdout;
+			fwrite(r->text, 1, r->length, out);
+			fputc('\n', out);
+			if (out == stderr)
+				wrote_err = true;
+			else
+				wrote_out = true;
+		}
+		ring->tail.store(tail, std::memory_order_release);
+		uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+		if (dropped != ring->dropped_reported) {
+			fprintf(stderr, "Logger: %llu messages dropped\n",
+				(unsigned long long)(dropped - ring->dropped_reported));
+			ring->dropped_reported = dropped;
+			wrote_err = true;
+		}
+	}
+	if (wrote_out)
+		fflush(stdout);
+	if (wrote_err)
+		fflush(stderr);
+	return wrote_out || wrote_err;
+}
+
+void Logger::Flush()
+{
+	Drain();
+}
+
+void Logger::DrainThread()
+{
+	while (running.load(std::memory_order_relaxed)) {
+		if (!Drain())
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+}
@@ -0,0 +1,103 @@
+// Apple 2 Super Duper High Resolution
+// Leveled asynchronous logger
+//
+// Each thread formats its messages into its own lock-free ring, and a
+// background thread drains all the rings to stdout/stderr. Logging never
+// blocks the caller: when a ring is full the message is dropped and counted.
+// Levels below SDHR_LOG_MIN_LEVEL are compiled out, their arguments are never
+// evaluated. Levels above it can still be filtered at runtime with the
+// SDHR_LOG_LEVEL environment variable (trace, debug, info, warn, error, none).
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum LogLevel_e {
+	LOG_LEVEL_TRACE = 0,
+	LOG_LEVEL_DEBUG,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_WARN,
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_NONE
+};
+
+#ifndef SDHR_LOG_MIN_LEVEL
+#define SDHR_LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define SDHR_LOG(level, ...) \
+	do { \
+		if constexpr ((level) >= SDHR_LOG_MIN_LEVEL) { \
+			if (Logger::IsEnabled(level)) \
+				Logger::GetInstance()->Log(level, __VA_ARGS__); \
+		} \
+	} while (0)
+
+#define SDHR_LOG_TRACE(...) SDHR_LOG(LOG_LEVEL_TRACE, __VA_ARGS__)
+#define SDHR_LOG_DEBUG(...) SDHR_LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define SDHR_LOG_INFO(...) SDHR_LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define SDHR_LOG_WARN(...) SDHR_LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define SDHR_LOG_ERROR(...) SDHR_LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#define LOGGER_RING_SIZE 1024		// records per thread, must be a power of 2
+#define LOGGER_RECORD_TEXT 240		// longer messages are truncated
+
+class Logger
+{
+public:
+	void Log(LogLevel_e level, const char* format, ...) __attribute__((format(printf, 3, 4)));
+	// Writes out everything logged so far, from any thread
+	void Flush();
+
+	static bool IsEnabled(LogLevel_e level) {
+		return level >= s_runtime_level.load(std::memory_order_relaxed);
+	}
+	static void SetLevel(LogLevel_e level) {
+		s_runtime_level.store(level, std::memory_order_relaxed);
+	}
+
+	// public singleton code
+	static Logger* GetInstance()
+	{
+		if (NULL == s_instance)
+			s_instance = new Logger();
+		return s_instance;
+	}
+	~Logger();
+private:
+	static Logger* s_instance;
+	static std::atomic<int> s_runtime_level;
+	Logger();
+
+	struct LogRecord {
+		uint8_t level;
+		uint16_t length;
+		char text[LOGGER_RECORD_TEXT];
+	};
+
+	// Single producer (the owning thread), single consumer (the drain thread)
+	struct LogRing {
+		std::atomic<uint64_t> head;		// written by the producer
+		std::atomic<uint64_t> tail;		// written by the consumer
+		std::atomic<uint64_t> dropped;	// written by the producer
+		uint64_t dropped_reported;		// consumer only
+		LogRecord records[LOGGER_RING_SIZE];
+		LogRing() : head(0), tail(0), dropped(0), dropped_reported(0) {}
+	};
+
+	LogRing* GetThreadRing();
+	bool Drain();
+	void DrainThread();
+	static void FlushAtExit();
+
+	std::mutex rings_mutex;			// taken once per thread on registration, and by the drainer
+	std::vector<LogRing*> rings;
+	std::mutex drain_mutex;			// serializes Drain() between the drain thread and Flush()
+	std::atomic<bool> running;
+	std::thread drain_thread;
+};
@@ -0,0 +1,145 @@
+#include "MappedRegion.h"
+#include "Logger.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+enum HugePagePolicy_e {
+	HUGEPAGE_POLICY_OFF = 0,
+	HUGEPAGE_POLICY_TRANSPARENT,
+	HUGEPAGE_POLICY_EXPLICIT,
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Static helpers
+//////////////////////////////////////////////////////////////////////////
+
+static HugePagePolicy_e ReadPolicy()
+{
+	const char* env = getenv("SDHR_HUGEPAGES");
+	if (env == NULL || *env == 0 || strcmp(env, "0") == 0 || strcmp(env, "off") == 0)
+		return HUGEPAGE_POLICY_OFF;
+	if (strcmp(env, "transparent") == 0)
+		return HUGEPAGE_POLICY_TRANSPARENT;
+	if (strcmp(env, "explicit") == 0)
+		return HUGEPAGE_POLICY_EXPLICIT;
+	SDHR_LOG_WARN("SDHR_HUGEPAGES=%s is not transparent, explicit or 0, using base pages", env);
+	return HUGEPAGE_POLICY_OFF;
+}
+
+static HugePagePolicy_e Policy()
+{
+	static const HugePagePolicy_e policy = ReadPolicy();
+	return policy;
+}
+
+static uint64_t ReadHugePageSize()
+{
+	uint64_t size = 0;
+	FILE* f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if (f) {
+		unsigned long long value;
+		if (fscanf(f, "%llu", &value) == 1)
+			size = value;
+		fclose(f);
+	}
+	return size ? size : 2ull << 20;
+}
+
+static uint64_t RoundUp(uint64_t value, uint64_t multiple)
+{
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+static uint8_t* MapAnonymous(uint64_t size, int extra_flags)
+{
+	// hugetlb pages must be reserved now, or touching them later raises SIGBUS
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | extra_flags;
+	if (!(extra_flags & MAP_HUGETLB))
+		flags |= MAP_NORESERVE;
+	void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	return base == MAP_FAILED ? NULL : (uint8_t*)base;
+}
+
+// Over-maps by a huge page and cuts the ends off, so the kernel can use huge pages from the start
+static uint8_t* MapAligned(uint64_t size, uint64_t alignment)
+{
+	uint8_t* raw = MapAnonymous(size + alignment, 0);
+	if (raw == NULL)
+		return NULL;
+	uint8_t* base = (uint8_t*)RoundUp((uintptr_t)raw, alignment);
+	if (base > raw)
+		munmap(raw, base - raw);
+	munmap(base + size, raw + alignment - base);
+	return base;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Methods
+//////////////////////////////////////////////////////////////////////////
+
+uint64_t HugePageSize()
+{
+	static const uint64_t size = ReadHugePageSize();
+	return size;
+}
+
+bool MappedRegion::Map(uint64_t map_size, MetricRegion_e map_region)
+{
+	region = map_region;
+	pages = METRIC_PAGES_BASE;
+	size = map_size;
+	base = NULL;
+	uint64_t huge = HugePageSize();
+	if (Policy() != HUGEPAGE_POLICY_OFF && map_size >= huge) {
+		uint64_t huge_size = RoundUp(map_size, huge);
+		if (Policy() == HUGEPAGE_POLICY_EXPLICIT) {
+			base = MapAnonymous(huge_size, MAP_HUGETLB);
+			if (base) {
+				size = huge_size;
+				pages = METRIC_PAGES_EXPLICIT_HUGE;
+			}
+			else {
+				SDHR_LOG_DEBUG("MappedRegion: no explicit huge pages for %llu bytes: %s",
+					(unsigned long long)huge_size, strerror(errno));
+			}
+		}
+		if (base == NULL) {
+			base = MapAligned(huge_size, huge);
+			if (base) {
+				size = huge_size;
+				if (madvise(base, size, MADV_HUGEPAGE) == 0)
+					pages = METRIC_PAGES_TRANSPARENT_ADVISED;
+			}
+		}
+	}
+	if (base == NULL)
+		base = MapAnonymous(size, 0);
+	if (base == NULL) {
+		SDHR_LOG_ERROR("MappedRegion: cannot map %llu bytes: %s", (unsigned long long)size, strerror(errno));
+		size = 0;
+		return false;
+	}
+	Metrics::AddRegionBytes(region, pages, (int64_t)size);
+	return true;
+}
+
+void MappedRegion::Unmap()
+{
+	if (base == NULL)
+		return;
+	munmap(base, size);
+	Metrics::AddRegionBytes(region, pages, -(int64_t)size);
+	base = NULL;
+	size = 0;
+}
+
+void MappedRegion::Zero()
+{
+	// hugetlb mappings only take MADV_DONTNEED on recent kernels
+	if (base && madvise(base, size, MADV_DONTNEED) != 0)
+		memset(base, 0, size);
+}
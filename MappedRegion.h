@@ -0,0 +1,35 @@
+// Apple 2 Super Duper High Resolution
+// Anonymous mappings for the big, long lived buffers
+//
+// The uploaded data region, the tile atlas slabs and the headless render
+// surfaces are mapped here rather than allocated from the heap. Pages are
+// zeroed and only committed when written. Huge pages keep the renderer's
+// jumps between tiles from missing the TLB, but a single write commits a
+// whole huge page, so they are opt-in. Regions of at least one huge page then
+// ask for them:
+//   SDHR_HUGEPAGES unset or 0          base pages only
+//   SDHR_HUGEPAGES=transparent         madvise(MADV_HUGEPAGE) on an aligned mapping
+//   SDHR_HUGEPAGES=explicit            MAP_HUGETLB from the reserved pool, else transparent
+// The sdhr_mapped_region_bytes gauge tells which regions got which pages.
+
+#pragma once
+
+#include <stdint.h>
+#include "Metrics.h"
+
+struct MappedRegion {
+	uint8_t* base = NULL;
+	uint64_t size = 0;		// may be rounded up from the size asked for
+	MetricRegion_e region = METRIC_REGION_UPLOAD;
+	MetricPages_e pages = METRIC_PAGES_BASE;
+
+	bool IsHuge() const { return pages != METRIC_PAGES_BASE; }
+	// Maps size zeroed bytes, false if even base pages can't be mapped
+	bool Map(uint64_t size, MetricRegion_e region);
+	void Unmap();
+	// Back to all zeroes, giving the pages back where the kernel allows
+	void Zero();
+};
+
+// Bytes in a transparent huge page, 2MB on most systems
+uint64_t HugePageSize();
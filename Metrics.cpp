@@ -0,0 +1,279 @@
+#include "Metrics.h"
+#include "FrameTiming.h"
+#include "Logger.h"
+#include "SDHRManager.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+#include <algorithm>
+
+// below because "The declaration of a static data member in its class definition is not a definition"
+Metrics* Metrics::s_instance;
+
+//////////////////////////////////////////////////////////////////////////
+// Static helpers
+//////////////////////////////////////////////////////////////////////////
+
+struct MetricDescription {
+	const char* name;
+	const char* labels;
+	const char* help;
+};
+
+static const MetricDescription CounterDescriptions[METRIC_COUNTER_COUNT] = {
+	{ "sdhr_packets_received_total", "", "Bus packets received from the client" },
+	{ "sdhr_bytes_received_total", "", "Bytes received from the client" },
+	{ "sdhr_packets_total", "type=\"memory_write\"", "Bus packets by type" },
+	{ "sdhr_packets_total", "type=\"control\"", NULL },
+	{ "sdhr_packets_total", "type=\"data\"", NULL },
+	{ "sdhr_packets_total", "type=\"bad\"", NULL },
+	{ "sdhr_command_errors_total", "", "Commands that failed" },
+	{ "sdhr_decoded_asset_bytes_total", "", "Bytes of decoded image asset pixels" },
+	{ "sdhr_frames_rendered_total", "", "Frames drawn into a framebuffer" },
+	{ "sdhr_frames_skipped_total", "", "PROCESS batches that did not produce a frame" },
+	{ "sdhr_asset_cache_lookups_total", "result=\"hit\"", "Image asset decodes served by the asset cache" },
+	{ "sdhr_asset_cache_lookups_total", "result=\"miss\"", NULL },
+	{ "sdhr_disk_cache_lookups_total", "result=\"hit\"", "Assets and tilesets mapped from SDHR_CACHE_DIR" },
+	{ "sdhr_disk_cache_lookups_total", "result=\"miss\"", NULL },
+	{ "sdhr_tiles_deduplicated_total", "", "Tileset entries stored as a reference to an identical tile" },
+};
+
+static const char* RegionNames[METRIC_REGION_COUNT] = { "upload", "apple2_memory", "tile_atlas", "surface" };
+static const char* PagesNames[METRIC_PAGES_COUNT] = { "base", "transparent_advised", "explicit_huge" };
+
+// AnonHugePages of the whole process: the transparent huge pages the kernel really gave
+static int64_t ReadAnonHugePageBytes()
+{
+	FILE* f = fopen("/proc/self/smaps_rollup", "r");
+	if (f == NULL)
+		return -1;
+	char line[256];
+	long long kb = -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "AnonHugePages: %lld kB", &kb) == 1)
+			break;
+	}
+	fclose(f);
+	return kb < 0 ? -1 : (int64_t)kb * 1024;
+}
+
+static void AppendF(std::string& s, const char* format, ...) __attribute__((format(printf, 2, 3)));
+static void AppendF(std::string& s, const char* format, ...)
+{
+	char buf[512];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	if (len > 0)
+		s.append(buf, std::min((size_t)len, sizeof(buf) - 1));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Methods
+//////////////////////////////////////////////////////////////////////////
+
+Metrics::Metrics()
+	: listen_fd(-1)
+{
+	for (int i = 0; i < METRIC_GAUGE_COUNT; ++i)
+		gauges[i] = 0;
+	for (int r = 0; r < METRIC_REGION_COUNT; ++r) {
+		for (int p = 0; p < METRIC_PAGES_COUNT; ++p)
+			region_bytes[r][p] = 0;
+	}
+}
+
+Metrics::~Metrics()
+{
+	if (listen_fd >= 0) {
+		shutdown(listen_fd, SHUT_RDWR);
+		close(listen_fd);
+		unlink(socket_path.c_str());
+	}
+	if (server_thread.joinable())
+		server_thread.detach();
+}
+
+Metrics::ThreadBlock* Metrics::RegisterThread()
+{
+	ThreadBlock* block = new ThreadBlock();
+	for (int i = 0; i < METRIC_COUNTER_COUNT; ++i)
+		block->counters[i] = 0;
+	for (int i = 0; i < 256; ++i) {
+		block->commands[i] = 0;
+		block->compressed_bytes[i] = 0;
+		block->uncompressed_bytes[i] = 0;
+	}
+	std::lock_guard<std::mutex> lock(blocks_mutex);
+	blocks.push_back(block);
+	return block;
+}
+
+std::string Metrics::Snapshot()
+{
+	uint64_t counters[METRIC_COUNTER_COUNT] = {};
+	uint64_t commands[256] = {};
+	uint64_t compressed_bytes[256] = {};
+	uint64_t uncompressed_bytes[256] = {};
+	{
+		std::lock_guard<std::mutex> lock(blocks_mutex);
+		for (ThreadBlock* block : blocks) {
+			for (int i = 0; i < METRIC_COUNTER_COUNT; ++i)
+				counters[i] += block->counters[i].load(std::memory_order_relaxed);
+			for (int i = 0; i < 256; ++i) {
+				commands[i] += block->commands[i].load(std::memory_order_relaxed);
+				compressed_bytes[i] += block->compressed_bytes[i].load(std::memory_order_relaxed);
+				uncompressed_bytes[i] += block->uncompressed_bytes[i].load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	std::string s;
+	s.reserve(16384);
+	for (int i = 0; i < METRIC_COUNTER_COUNT; ++i) {
+		const MetricDescription& d = CounterDescriptions[i];
+		if (d.help) {
+			AppendF(s, "# HELP %s %s\n# TYPE %s counter\n", d.name, d.help, d.name);
+		}
+		if (*d.labels)
+			AppendF(s, "%s{%s} %llu\n", d.name, d.labels, (unsigned long long)counters[i]);
+		else
+			AppendF(s, "%s %llu\n", d.name, (unsigned long long)counters[i]);
+	}
+
+	s += "# HELP sdhr_commands_total Commands executed by command id\n# TYPE sdhr_commands_total counter\n";
+	for (int i = 0; i < 256; ++i) {
+		if (commands[i])
+			AppendF(s, "sdhr_commands_total{cmd=\"%s\",id=\"%d\"} %llu\n",
+				SDHRManager::CommandName((uint8_t)i), i, (unsigned long long)commands[i]);
+	}
+	s += "# HELP sdhr_compressed_command_bytes_total Size of COMPRESSED commands before and after decompression, by the command inside\n"
+		"# TYPE sdhr_compressed_command_bytes_total counter\n";
+	for (int i = 0; i < 256; ++i) {
+		if (uncompressed_bytes[i]) {
+			const char* name = SDHRManager::CommandName((uint8_t)i);
+			AppendF(s, "sdhr_compressed_command_bytes_total{cmd=\"%s\",form=\"compressed\"} %llu\n",
+				name, (unsigned long long)compressed_bytes[i]);
+			AppendF(s, "sdhr_compressed_command_bytes_total{cmd=\"%s\",form=\"uncompressed\"} %llu\n",
+				name, (unsigned long long)uncompressed_bytes[i]);
+		}
+	}
+
+	s += "# HELP sdhr_tileset_memory_bytes Memory held by tileset pixel data and tile maps\n# TYPE sdhr_tileset_memory_bytes gauge\n";
+	AppendF(s, "sdhr_tileset_memory_bytes %lld\n", (long long)gauges[METRIC_GAUGE_TILESET_BYTES].load());
+	s += "# HELP sdhr_asset_cache_bytes Decoded pixels held by the asset cache\n# TYPE sdhr_asset_cache_bytes gauge\n";
+	AppendF(s, "sdhr_asset_cache_bytes %lld\n", (long long)gauges[METRIC_GAUGE_ASSET_CACHE_BYTES].load());
+	s += "# HELP sdhr_tile_atlas_reserved_bytes Address space reserved by the tile atlas slabs\n# TYPE sdhr_tile_atlas_reserved_bytes gauge\n";
+	AppendF(s, "sdhr_tile_atlas_reserved_bytes %lld\n", (long long)gauges[METRIC_GAUGE_TILE_ATLAS_BYTES].load());
+	s += "# HELP sdhr_layer_cache_bytes Pixels held by the layers of unchanging windows\n# TYPE sdhr_layer_cache_bytes gauge\n";
+	AppendF(s, "sdhr_layer_cache_bytes %lld\n", (long long)gauges[METRIC_GAUGE_LAYER_CACHE_BYTES].load());
+	s += "# HELP sdhr_mapped_region_bytes Address space of the big mappings, by region and the pages asked for\n# TYPE sdhr_mapped_region_bytes gauge\n";
+	for (int r = 0; r < METRIC_REGION_COUNT; ++r) {
+		for (int p = 0; p < METRIC_PAGES_COUNT; ++p)
+			AppendF(s, "sdhr_mapped_region_bytes{region=\"%s\",pages=\"%s\"} %lld\n",
+				RegionNames[r], PagesNames[p], (long long)region_bytes[r][p].load());
+	}
+	int64_t anon_huge = ReadAnonHugePageBytes();
+	if (anon_huge >= 0) {
+		s += "# HELP sdhr_anon_huge_page_bytes Process memory the kernel backs with transparent huge pages\n# TYPE sdhr_anon_huge_page_bytes gauge\n";
+		AppendF(s, "sdhr_anon_huge_page_bytes %lld\n", (long long)anon_huge);
+	}
+
+	// Frame pacing comes from the frame timing ring, which has its own single-writer histograms
+	const FrameTimingShared* ft = FrameTiming::GetInstance()->GetShared();
+	s += "# HELP sdhr_missed_vblanks_total Vblanks that went by without a new frame\n# TYPE sdhr_missed_vblanks_total counter\n";
+	AppendF(s, "sdhr_missed_vblanks_total %llu\n", (unsigned long long)ft->missed_vblanks.load());
+	s += "# HELP sdhr_frame_span_microseconds Time between frame pipeline stages\n# TYPE sdhr_frame_span_microseconds histogram\n";
+	for (int span = 0; span < FRAME_SPAN_COUNT; ++span) {
+		const FrameTimingHistogram& h = ft->histograms[span];
+		uint64_t cumulative = 0;
+		for (uint32_t b = 0; b < FRAMETIMING_HISTOGRAM_BUCKETS; ++b) {
+			cumulative += h.buckets[b].load(std::memory_order_relaxed);
+			// bucket limits are exclusive, Prometheus' are inclusive
+			AppendF(s, "sdhr_frame_span_microseconds_bucket{span=\"%s\",le=\"%llu\"} %llu\n",
+				FrameSpanNames[span], (unsigned long long)(FrameTimingBucketLimit(b) - 1),
+				(unsigned long long)cumulative);
+		}
+		AppendF(s, "sdhr_frame_span_microseconds_bucket{span=\"%s\",le=\"+Inf\"} %llu\n",
+			FrameSpanNames[span], (unsigned long long)cumulative);
+		AppendF(s, "sdhr_frame_span_microseconds_sum{span=\"%s\"} %llu\n",
+			FrameSpanNames[span], (unsigned long long)h.sum_us.load(std::memory_order_relaxed));
+		AppendF(s, "sdhr_frame_span_microseconds_count{span=\"%s\"} %llu\n",
+			FrameSpanNames[span], (unsigned long long)cumulative);
+	}
+	return s;
+}
+
+void Metrics::StartServer()
+{
+	const char* path = getenv("SDHR_METRICS_SOCKET");
+	socket_path = (path && *path) ? path : "/tmp/sdhrserver.metrics";
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(addr.sun_path)) {
+		SDHR_LOG_ERROR("Metrics socket path too long: %s", socket_path.c_str());
+		return;
+	}
+	strcpy(addr.sun_path, socket_path.c_str());
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		SDHR_LOG_ERROR("Error creating metrics socket: %s", strerror(errno));
+		return;
+	}
+	unlink(socket_path.c_str());	// left over from a previous run
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listen_fd, 4) == -1) {
+		SDHR_LOG_ERROR("Error binding metrics socket %s: %s", socket_path.c_str(), strerror(errno));
+		close(listen_fd);
+		listen_fd = -1;
+		return;
+	}
+	server_thread = std::thread(&Metrics::ServerThread, this);
+	SDHR_LOG_INFO("Metrics available on %s", socket_path.c_str());
+}
+
+void Metrics::ServerThread()
+{
+	while (true) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		// Scrapers send an HTTP request, plain clients (socat, nc -U) send nothing
+		bool http = false;
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 100) > 0) {
+			char request[1024];
+			ssize_t n = recv(fd, request, sizeof(request), 0);
+			http = (n >= 4 && memcmp(request, "GET ", 4) == 0);
+		}
+		std::string body = Snapshot();
+		std::string reply;
+		if (http) {
+			char header[160];
+			snprintf(header, sizeof(header),
+				"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+				body.size());
+			reply = header;
+		}
+		reply += body;
+		size_t sent = 0;
+		while (sent < reply.size()) {
+			ssize_t n = send(fd, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0)
+				break;
+			sent += n;
+		}
+		close(fd);
+	}
+}
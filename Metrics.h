@@ -0,0 +1,129 @@
+// Apple 2 Super Duper High Resolution
+// Internal counters exposed as a Prometheus text snapshot
+//
+// Every thread increments its own block of counters with plain relaxed
+// stores, so the hot paths never contend on a shared cache line. A reader
+// connecting to the Unix socket (SDHR_METRICS_SOCKET, default
+// /tmp/sdhrserver.metrics) gets the sum of all blocks, the gauges and the
+// frame timing histograms. Both plain connections and HTTP GETs are answered.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum MetricCounter_e {
+	METRIC_PACKETS_RECEIVED = 0,
+	METRIC_BYTES_RECEIVED,
+	METRIC_MEMORY_WRITE_PACKETS,
+	METRIC_CONTROL_PACKETS,
+	METRIC_DATA_PACKETS,
+	METRIC_BAD_PACKETS,
+	METRIC_COMMAND_ERRORS,
+	METRIC_DECODED_ASSET_BYTES,
+	METRIC_FRAMES_RENDERED,
+	METRIC_FRAMES_SKIPPED,		// PROCESS batches that didn't lead to a frame
+	METRIC_ASSET_CACHE_HITS,
+	METRIC_ASSET_CACHE_MISSES,
+	METRIC_DISK_CACHE_HITS,
+	METRIC_DISK_CACHE_MISSES,
+	METRIC_TILES_DEDUPLICATED,	// tileset entries that reuse another entry's bitmap
+	METRIC_COUNTER_COUNT
+};
+
+enum MetricGauge_e {
+	METRIC_GAUGE_TILESET_BYTES = 0,
+	METRIC_GAUGE_ASSET_CACHE_BYTES,
+	METRIC_GAUGE_TILE_ATLAS_BYTES,
+	METRIC_GAUGE_LAYER_CACHE_BYTES,
+	METRIC_GAUGE_COUNT
+};
+
+// Big anonymous mappings, see MappedRegion.h
+enum MetricRegion_e {
+	METRIC_REGION_UPLOAD = 0,
+	METRIC_REGION_APPLE2_MEMORY,
+	METRIC_REGION_TILE_ATLAS,
+	METRIC_REGION_SURFACE,
+	METRIC_REGION_COUNT
+};
+
+enum MetricPages_e {
+	METRIC_PAGES_BASE = 0,
+	METRIC_PAGES_TRANSPARENT_ADVISED,	// MADV_HUGEPAGE was accepted, which THP "never" also does
+	METRIC_PAGES_EXPLICIT_HUGE,		// MAP_HUGETLB
+	METRIC_PAGES_COUNT
+};
+
+class Metrics
+{
+public:
+	static void Add(MetricCounter_e counter, uint64_t value = 1) {
+		bump(GetThreadBlock()->counters[counter], value);
+	}
+	static void CountCommand(uint8_t cmd) {
+		bump(GetThreadBlock()->commands[cmd], 1);
+	}
+	// A COMPRESSED command, by the first command inside it
+	static void CountCompressed(uint8_t cmd, uint64_t compressed_bytes, uint64_t uncompressed_bytes) {
+		ThreadBlock* block = GetThreadBlock();
+		bump(block->compressed_bytes[cmd], compressed_bytes);
+		bump(block->uncompressed_bytes[cmd], uncompressed_bytes);
+	}
+	static void SetGauge(MetricGauge_e gauge, int64_t value) {
+		GetInstance()->gauges[gauge].store(value, std::memory_order_relaxed);
+	}
+	static void AddRegionBytes(MetricRegion_e region, MetricPages_e pages, int64_t delta) {
+		GetInstance()->region_bytes[region][pages].fetch_add(delta, std::memory_order_relaxed);
+	}
+
+	// Starts the socket listener thread
+	void StartServer();
+	// Prometheus text exposition format
+	std::string Snapshot();
+
+	// public singleton code
+	static Metrics* GetInstance()
+	{
+		if (NULL == s_instance)
+			s_instance = new Metrics();
+		return s_instance;
+	}
+	~Metrics();
+private:
+	static Metrics* s_instance;
+	Metrics();
+
+	// Owned by a single thread, which is the only writer
+	struct ThreadBlock {
+		std::atomic<uint64_t> counters[METRIC_COUNTER_COUNT];
+		std::atomic<uint64_t> commands[256];
+		std::atomic<uint64_t> compressed_bytes[256];
+		std::atomic<uint64_t> uncompressed_bytes[256];
+	};
+
+	static void bump(std::atomic<uint64_t>& a, uint64_t v) {
+		a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+	}
+	static ThreadBlock* GetThreadBlock() {
+		thread_local ThreadBlock* block = NULL;
+		if (block == NULL)
+			block = GetInstance()->RegisterThread();
+		return block;
+	}
+	ThreadBlock* RegisterThread();
+	void ServerThread();
+
+	std::mutex blocks_mutex;
+	std::vector<ThreadBlock*> blocks;
+	std::atomic<int64_t> gauges[METRIC_GAUGE_COUNT];
+	std::atomic<int64_t> region_bytes[METRIC_REGION_COUNT][METRIC_PAGES_COUNT];
+	std::string socket_path;
+	int listen_fd;
+	std::thread server_thread;
+};
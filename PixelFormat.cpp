@@ -0,0 +1,114 @@
+#include "PixelFormat.h"
+#include <cstdlib>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SDHR_PIXEL_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SDHR_PIXEL_NEON 1
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// Kernels
+//////////////////////////////////////////////////////////////////////////
+
+static void ConvertRGBAToARGB_Scalar(uint8_t* data, uint64_t pixel_count)
+{
+	// swap R and B
+	for (uint64_t i = 0; i < pixel_count; ++i) {
+		uint32_t v;
+		memcpy(&v, data + i * 4, 4);
+		v = (v & 0xFF00FF00) | ((v & 0x00FF0000) >> 16) | ((v & 0x000000FF) << 16);
+		memcpy(data + i * 4, &v, 4);
+	}
+}
+
+#if SDHR_PIXEL_X86
+__attribute__((target("ssse3")))
+static void ConvertRGBAToARGB_SSSE3(uint8_t* data, uint64_t pixel_count)
+{
+	const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	uint64_t i = 0;
+	for (; i + 4 <= pixel_count; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(data + i * 4));
+		_mm_storeu_si128((__m128i*)(data + i * 4), _mm_shuffle_epi8(v, shuffle));
+	}
+	ConvertRGBAToARGB_Scalar(data + i * 4, pixel_count - i);
+}
+
+__attribute__((target("avx2")))
+static void ConvertRGBAToARGB_AVX2(uint8_t* data, uint64_t pixel_count)
+{
+	// the shuffle works within each 128-bit lane, so the pattern is repeated
+	const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	uint64_t i = 0;
+	for (; i + 8 <= pixel_count; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(data + i * 4));
+		_mm256_storeu_si256((__m256i*)(data + i * 4), _mm256_shuffle_epi8(v, shuffle));
+	}
+	ConvertRGBAToARGB_Scalar(data + i * 4, pixel_count - i);
+}
+#endif
+
+#if SDHR_PIXEL_NEON
+static void ConvertRGBAToARGB_NEON(uint8_t* data, uint64_t pixel_count)
+{
+	// de-interleaved load, swap the R and B planes, interleaved store
+	uint64_t i = 0;
+	for (; i + 16 <= pixel_count; i += 16) {
+		uint8x16x4_t v = vld4q_u8(data + i * 4);
+		uint8x16_t r = v.val[0];
+		v.val[0] = v.val[2];
+		v.val[2] = r;
+		vst4q_u8(data + i * 4, v);
+	}
+	ConvertRGBAToARGB_Scalar(data + i * 4, pixel_count - i);
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// Dispatch
+//////////////////////////////////////////////////////////////////////////
+
+typedef void (*ConvertKernel)(uint8_t*, uint64_t);
+
+struct PixelKernel {
+	ConvertKernel convert;
+	const char* name;
+};
+
+static PixelKernel SelectKernel()
+{
+	const char* disable = getenv("SDHR_DISABLE_SIMD");
+	if (disable && *disable && strcmp(disable, "0") != 0)
+		return { ConvertRGBAToARGB_Scalar, "scalar" };
+#if SDHR_PIXEL_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return { ConvertRGBAToARGB_AVX2, "avx2" };
+	if (__builtin_cpu_supports("ssse3"))
+		return { ConvertRGBAToARGB_SSSE3, "ssse3" };
+#elif SDHR_PIXEL_NEON
+	return { ConvertRGBAToARGB_NEON, "neon" };
+#endif
+	return { ConvertRGBAToARGB_Scalar, "scalar" };
+}
+
+// resolved once, thread-safe static initialization
+static const PixelKernel& Kernel()
+{
+	static const PixelKernel kernel = SelectKernel();
+	return kernel;
+}
+
+void ConvertRGBAToARGB(uint8_t* data, uint64_t pixel_count)
+{
+	Kernel().convert(data, pixel_count);
+}
+
+const char* PixelKernelName()
+{
+	return Kernel().name;
+}
@@ -0,0 +1,18 @@
+// Apple 2 Super Duper High Resolution
+// Pixel format conversion kernels
+//
+// stb_image decodes to RGBA bytes while tiles and the framebuffer use native
+// 32-bit ARGB. The conversion runs once per decoded asset, with the fastest
+// kernel the CPU supports: AVX2 or SSSE3 byte shuffles on x86, NEON on ARM,
+// and a scalar loop otherwise. SDHR_DISABLE_SIMD=1 forces the scalar loop,
+// which gives the reference output.
+
+#pragma once
+
+#include <stdint.h>
+
+// In place, RGBA bytes to native 32-bit ARGB (BGRA bytes on little endian)
+void ConvertRGBAToARGB(uint8_t* data, uint64_t pixel_count);
+
+// Name of the kernel ConvertRGBAToARGB uses on this machine
+const char* PixelKernelName();
@@ -0,0 +1,624 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <zlib.h>
+#include "SDHRManager.h"
+#include "SDHRPacket.h"
+#include "HeadlessFramebuffer.h"
+#include "PixelFormat.h"
+
+/**
+ *
+ * SDHRBench
+ * Microbenchmarks for the renderer, the command parser, tile extraction,
+ * inflate and the packet decode loop. SDHRManager is driven through the same
+ * commands a client sends, and draws into a framebuffer in plain memory,
+ * so no DRM device is needed.
+ * Results are written as JSON (to stdout, or the --out file) so runs of
+ * different versions can be compared.
+ *
+ * Usage: SDHRBench [--filter <substring>] [--min-time <seconds>] [--out <file>]
+ *
+ */
+
+typedef std::chrono::steady_clock BenchClock;
+
+struct BenchResult {
+	std::string name;
+	std::string label;
+	std::string params;		// JSON object
+	uint64_t iterations;
+	double items_per_iteration;
+	double ns_min;
+	double ns_median;
+	double ns_mean;
+	double ns_max;
+};
+
+static double g_min_time = 0.2;
+static std::string g_filter;
+static std::vector<BenchResult> g_results;
+
+static bool Selected(const std::string& label)
+{
+	return g_filter.empty() || label.find(g_filter) != std::string::npos;
+}
+
+// Runs setup() then times body() until at least g_min_time seconds went by
+template <typename Setup, typename Body>
+static void RunBench(const std::string& name, const std::string& label, const std::string& params,
+	double items_per_iteration, Setup setup, Body body)
+{
+	std::vector<double> samples;
+	auto bench_start = BenchClock::now();
+	while (samples.size() < 3 ||
+		(std::chrono::duration<double>(BenchClock::now() - bench_start).count() < g_min_time
+			&& samples.size() < 100000)) {
+		setup();
+		auto t0 = BenchClock::now();
+		body();
+		auto t1 = BenchClock::now();
+		samples.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+	}
+	std::sort(samples.begin(), samples.end());
+	double sum = 0;
+	for (double s : samples)
+		sum += s;
+	BenchResult r;
+	r.name = name;
+	r.label = label;
+	r.params = params;
+	r.iterations = samples.size();
+	r.items_per_iteration = items_per_iteration;
+	r.ns_min = samples.front();
+	r.ns_median = samples[samples.size() / 2];
+	r.ns_mean = sum / samples.size();
+	r.ns_max = samples.back();
+	g_results.push_back(r);
+	fprintf(stderr, "%-48s %12.0f ns/iter %10.2f ns/item (%llu iterations)\n", label.c_str(),
+		r.ns_median, r.ns_median / items_per_iteration, (unsigned long long)r.iterations);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Synthetic data
+//////////////////////////////////////////////////////////////////////////
+
+static void PutBE32(std::vector<uint8_t>& v, uint32_t x)
+{
+	v.push_back(x >> 24);
+	v.push_back(x >> 16);
+	v.push_back(x >> 8);
+	v.push_back(x);
+}
+
+static void PutPNGChunk(std::vector<uint8_t>& png, const char* type, const uint8_t* data, uint32_t len)
+{
+	PutBE32(png, len);
+	size_t type_pos = png.size();
+	png.insert(png.end(), type, type + 4);
+	png.insert(png.end(), data, data + len);
+	PutBE32(png, crc32(0, png.data() + type_pos, len + 4));
+}
+
+// Minimal 8-bit RGBA PNG encoder, enough to feed stb_image
+static std::vector<uint8_t> EncodePNG(const std::vector<uint8_t>& rgba, uint32_t width, uint32_t height)
+{
+	std::vector<uint8_t> raw;
+	raw.reserve(((size_t)width * 4 + 1) * height);
+	for (uint32_t y = 0; y < height; ++y) {
+		raw.push_back(0);	// no filter
+		raw.insert(raw.end(), rgba.begin() + (size_t)y * width * 4, rgba.begin() + (size_t)(y + 1) * width * 4);
+	}
+	uLongf zlen = compressBound(raw.size());
+	std::vector<uint8_t> z(zlen);
+	compress2(z.data(), &zlen, raw.data(), raw.size(), Z_BEST_SPEED);
+
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+	std::vector<uint8_t> png(signature, signature + 8);
+	std::vector<uint8_t> ihdr;
+	PutBE32(ihdr, width);
+	PutBE32(ihdr, height);
+	ihdr.push_back(8);	// bit depth
+	ihdr.push_back(6);	// RGBA
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	PutPNGChunk(png, "IHDR", ihdr.data(), ihdr.size());
+	PutPNGChunk(png, "IDAT", z.data(), zlen);
+	PutPNGChunk(png, "IEND", NULL, 0);
+	return png;
+}
+
+static std::vector<uint8_t> Deflate(const std::vector<uint8_t>& data)
+{
+	uLongf zlen = compressBound(data.size());
+	std::vector<uint8_t> z(zlen);
+	compress2(z.data(), &zlen, data.data(), data.size(), Z_DEFAULT_COMPRESSION);
+	z.resize(zlen);
+	return z;
+}
+
+// Commands as the client sends them
+struct CommandStream {
+	std::vector<uint8_t> bytes;
+	uint32_t count = 0;
+
+	// The length counts the whole command, header included: that's how ProcessCommands advances
+	void Add(SDHRCmd_e cmd, const void* payload, size_t payload_len, const void* extra = NULL, size_t extra_len = 0) {
+		uint16_t len = (uint16_t)(3 + payload_len + extra_len);
+		bytes.push_back(len & 0xff);
+		bytes.push_back(len >> 8);
+		bytes.push_back((uint8_t)cmd);
+		bytes.insert(bytes.end(), (const uint8_t*)payload, (const uint8_t*)payload + payload_len);
+		if (extra_len)
+			bytes.insert(bytes.end(), (const uint8_t*)extra, (const uint8_t*)extra + extra_len);
+		++count;
+	}
+	template <typename T>
+	void Add(SDHRCmd_e cmd, const T& payload, const void* extra = NULL, size_t extra_len = 0) {
+		Add(cmd, &payload, sizeof(payload), extra, extra_len);
+	}
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Benchmarks
+//////////////////////////////////////////////////////////////////////////
+
+class SDHRBench
+{
+public:
+	SDHRBench()
+		: mgr(SDHRManager::GetInstance())
+		, fb(640, 360)
+		, rng(1234)
+	{}
+
+	void BenchDrawWindows();
+	void BenchDrawWindowLayers();
+	void BenchProcessCommands();
+	void BenchTileExtraction();
+	void BenchInflate();
+	void BenchPacketDecode();
+
+private:
+	void Reset() {
+		mgr->ResetSdhr();
+		mgr->ToggleSdhr(true);
+	}
+	void Run(const CommandStream& stream) {
+		for (uint8_t b : stream.bytes)
+			mgr->AddPacketDataToBuffer(b);
+		if (!mgr->ProcessCommands()) {
+			fprintf(stderr, "SDHRBench: command setup failed: %s\n", mgr->error_str);
+			exit(1);
+		}
+		mgr->ClearBuffer();
+	}
+	void Upload(uint64_t dest_offset, const uint8_t* data, size_t len);
+	void DefineAsset(uint8_t asset_index, uint16_t tile_dim, int transparent_percent);
+	void DefineTileset(uint8_t tileset_index, uint8_t asset_index, uint16_t tile_dim);
+	void DefineWindows(uint32_t count, uint16_t tile_dim, bool wrap);
+	void SetupDrawWindows(uint32_t count, uint16_t tile_dim, int transparent_percent, bool wrap);
+	std::vector<uint8_t> TileOffsets();
+
+	SDHRManager* mgr;
+	HeadlessFramebuffer fb;
+	std::mt19937 rng;
+};
+
+// Goes through a2mem and UPLOAD_DATA like a client does
+void SDHRBench::Upload(uint64_t dest_offset, const uint8_t* data, size_t len)
+{
+	uint8_t* a2mem = mgr->GetApple2MemPtr();
+	size_t blocks = (len + 511) / 512;
+	for (size_t first = 0; first < blocks; first += 64) {
+		CommandStream s;
+		for (size_t b = first; b < std::min(blocks, first + 64); ++b) {
+			uint16_t source_addr = (uint16_t)(0x200 + (b - first) * 512);
+			size_t n = std::min((size_t)512, len - b * 512);
+			memset(a2mem + source_addr, 0, 512);
+			memcpy(a2mem + source_addr, data + b * 512, n);
+			UploadDataCmd cmd = { (uint16_t)(dest_offset / 512 + b), source_addr };
+			s.Add(SDHR_CMD_UPLOAD_DATA, cmd);
+		}
+		Run(s);
+	}
+}
+
+// A 16x16 grid of tiles. DefineTileset scales y offsets by xdim, so tiles are square.
+void SDHRBench::DefineAsset(uint8_t asset_index, uint16_t tile_dim, int transparent_percent)
+{
+	uint32_t dim = 16 * tile_dim;
+	std::vector<uint8_t> rgba((size_t)dim * dim * 4);
+	std::uniform_int_distribution<int> byte_dist(0, 255);
+	std::uniform_int_distribution<int> percent_dist(0, 99);
+	for (size_t i = 0; i < rgba.size(); i += 4) {
+		rgba[i] = byte_dist(rng);
+		rgba[i + 1] = byte_dist(rng);
+		rgba[i + 2] = byte_dist(rng);
+		rgba[i + 3] = percent_dist(rng) < transparent_percent ? 0 : 255;
+	}
+	std::vector<uint8_t> png = EncodePNG(rgba, dim, dim);
+	Upload(0, png.data(), png.size());
+	CommandStream s;
+	DefineImageAssetCmd cmd = { asset_index, (uint16_t)((png.size() + 511) / 512) };
+	s.Add(SDHR_CMD_DEFINE_IMAGE_ASSET, cmd);
+	Run(s);
+	// the decode runs on the worker pool
+	mgr->image_assets[asset_index].Resolve(mgr);
+}
+
+std::vector<uint8_t> SDHRBench::TileOffsets()
+{
+	std::vector<uint8_t> offsets;
+	for (uint16_t i = 0; i < 256; ++i) {
+		uint16_t xy[2] = { (uint16_t)(i % 16), (uint16_t)(i / 16) };
+		offsets.insert(offsets.end(), (uint8_t*)xy, (uint8_t*)xy + 4);
+	}
+	return offsets;
+}
+
+void SDHRBench::DefineTileset(uint8_t tileset_index, uint8_t asset_index, uint16_t tile_dim)
+{
+	std::vector<uint8_t> offsets = TileOffsets();
+	Upload(0, offsets.data(), offsets.size());
+	CommandStream s;
+	DefineTilesetCmd cmd = { tileset_index, asset_index, 0, tile_dim, tile_dim, (uint16_t)((offsets.size() + 511) / 512) };
+	s.Add(SDHR_CMD_DEFINE_TILESET, cmd);
+	Run(s);
+}
+
+// Tiles the screen with count windows (1, 16 or 256), filled with random tiles of tileset 0.
+// With wrap the view straddles the end of the tile array in both directions.
+void SDHRBench::DefineWindows(uint32_t count, uint16_t tile_dim, bool wrap)
+{
+	uint32_t grid = (uint32_t)std::lround(std::sqrt((double)count));
+	uint16_t wx = 640 / grid;
+	uint16_t wy = 360 / grid;
+	uint16_t tx = (wx + tile_dim - 1) / tile_dim;
+	uint16_t ty = (wy + tile_dim - 1) / tile_dim;
+	std::uniform_int_distribution<int> tile_dist(0, 255);
+	for (uint32_t i = 0; i < count; ++i) {
+		CommandStream s;
+		DefineWindowCmd def = { (uint8_t)i, wx, wy, tile_dim, tile_dim, tx, ty };
+		s.Add(SDHR_CMD_DEFINE_WINDOW, def);
+		std::vector<uint8_t> tiles((size_t)tx * ty * 2);
+		for (size_t t = 0; t < tiles.size(); t += 2) {
+			tiles[t] = 0;
+			tiles[t + 1] = tile_dist(rng);
+		}
+		UpdateWindowSetImmediateCmd set_cmd = { (uint8_t)i, (uint16_t)tiles.size() };
+		s.Add(SDHR_CMD_UPDATE_WINDOW_SET_IMMEDIATE, set_cmd, tiles.data(), tiles.size());
+		UpdateWindowSetWindowPositionCmd pos = { (uint8_t)i, (int32_t)((i % grid) * wx), (int32_t)((i / grid) * wy) };
+		s.Add(SDHR_CMD_UPDATE_WINDOW_SET_WINDOW_POSITION, pos);
+		UpdateWindowAdjustWindowViewCommand view = { (uint8_t)i, 0, 0 };
+		if (wrap) {
+			view.tile_xbegin = tx * tile_dim - wx / 2;
+			view.tile_ybegin = ty * tile_dim - wy / 2;
+		}
+		s.Add(SDHR_CMD_UPDATE_WINDOW_ADJUST_WINDOW_VIEW, view);
+		UpdateWindowEnableCmd enable = { (uint8_t)i, 1 };
+		s.Add(SDHR_CMD_UPDATE_WINDOW_ENABLE, enable);
+		Run(s);
+	}
+}
+
+void SDHRBench::SetupDrawWindows(uint32_t count, uint16_t tile_dim, int transparent_percent, bool wrap)
+{
+	Reset();
+	DefineAsset(0, tile_dim, transparent_percent);
+	DefineTileset(0, 0, tile_dim);
+	DefineWindows(count, tile_dim, wrap);
+}
+
+// Every frame looks up the tiles: window layers are off, or the unchanged
+// windows would be copied from their layers after a few frames
+void SDHRBench::BenchDrawWindows()
+{
+	static const uint32_t window_counts[] = { 1, 16, 256 };
+	static const uint16_t tile_dims[] = { 8, 16, 32 };
+	static const int transparent_percents[] = { 0, 50, 100 };
+	uint64_t layer_budget = mgr->layer_cache_budget;
+	mgr->layer_cache_budget = 0;
+	for (uint16_t tile_dim : tile_dims) {
+		for (int transparent : transparent_percents) {
+			for (uint32_t count : window_counts) {
+				for (int wrap = 0; wrap < 2; ++wrap) {
+					char label[128];
+					snprintf(label, sizeof(label), "draw_windows/w%u_t%u_a%d_%s",
+						count, tile_dim, transparent, wrap ? "wrap" : "nowrap");
+					if (!Selected(label))
+						continue;
+					SetupDrawWindows(count, tile_dim, transparent, wrap);
+					char params[160];
+					snprintf(params, sizeof(params),
+						"{\"windows\":%u,\"tile\":%u,\"transparent_percent\":%d,\"wrap\":%s}",
+						count, tile_dim, transparent, wrap ? "true" : "false");
+					RunBench("draw_windows", label, params, 640.0 * 360.0,
+						[] {},
+						[&] { mgr->DrawWindowsIntoBuffer(&fb.buf); });
+				}
+			}
+		}
+	}
+	mgr->layer_cache_budget = layer_budget;
+}
+
+// Windows that don't change, drawn from their layers (SDHR_LAYER_CACHE_MB applies)
+void SDHRBench::BenchDrawWindowLayers()
+{
+	static const uint32_t window_counts[] = { 1, 16, 256 };
+	static const int transparent_percents[] = { 0, 50 };
+	for (int transparent : transparent_percents) {
+		for (uint32_t count : window_counts) {
+			char label[128];
+			snprintf(label, sizeof(label), "draw_window_layers/w%u_t16_a%d", count, transparent);
+			if (!Selected(label))
+				continue;
+			SetupDrawWindows(count, 16, transparent, false);
+			// the layers are built once the windows have stayed the same long enough
+			for (uint32_t i = 0; i <= SDHRManager::LAYER_STEADY_FRAMES; ++i)
+				mgr->DrawWindowsIntoBuffer(&fb.buf);
+			char params[160];
+			snprintf(params, sizeof(params),
+				"{\"windows\":%u,\"tile\":16,\"transparent_percent\":%d,\"layer_cache_mb\":%llu}",
+				count, transparent, (unsigned long long)(mgr->layer_cache_budget >> 20));
+			RunBench("draw_window_layers", label, params, 640.0 * 360.0,
+				[] {},
+				[&] { mgr->DrawWindowsIntoBuffer(&fb.buf); });
+		}
+	}
+}
+
+void SDHRBench::BenchProcessCommands()
+{
+	const char* mixed_label = "process_commands/mixed_1024";
+	if (Selected(mixed_label)) {
+		Reset();
+		DefineAsset(0, 16, 0);
+		DefineTileset(0, 0, 16);
+		DefineWindows(16, 16, false);
+		CommandStream stream;
+		std::uniform_int_distribution<int> kind_dist(0, 3);
+		std::uniform_int_distribution<int> window_dist(0, 15);
+		std::uniform_int_distribution<int> pos_dist(-64, 640);
+		std::uniform_int_distribution<int> dir_dist(-1, 1);
+		while (stream.count < 1024) {
+			uint8_t w = (uint8_t)window_dist(rng);
+			switch (kind_dist(rng)) {
+			case 0: {
+				UpdateWindowSetWindowPositionCmd c = { w, pos_dist(rng), pos_dist(rng) };
+				stream.Add(SDHR_CMD_UPDATE_WINDOW_SET_WINDOW_POSITION, c);
+			} break;
+			case 1: {
+				UpdateWindowAdjustWindowViewCommand c = { w, pos_dist(rng), pos_dist(rng) };
+				stream.Add(SDHR_CMD_UPDATE_WINDOW_ADJUST_WINDOW_VIEW, c);
+			} break;
+			case 2: {
+				UpdateWindowShiftTilesCmd c = { w, (int8_t)dir_dist(rng), (int8_t)dir_dist(rng) };
+				stream.Add(SDHR_CMD_UPDATE_WINDOW_SHIFT_TILES, c);
+			} break;
+			default: {
+				UpdateWindowEnableCmd c = { w, 1 };
+				stream.Add(SDHR_CMD_UPDATE_WINDOW_ENABLE, c);
+			} break;
+			}
+		}
+		RunBench("process_commands", mixed_label, "{\"commands\":1024,\"windows\":16}", stream.count,
+			[&] { mgr->command_buffer = stream.bytes; },
+			[&] { mgr->ProcessCommands(); });
+	}
+
+	// a 64x64 tile map, set immediately or uploaded compressed
+	const char* immediate_label = "process_commands/set_immediate_64x64";
+	const char* upload_label = "process_commands/set_upload_64x64";
+	if (Selected(immediate_label) || Selected(upload_label)) {
+		Reset();
+		DefineAsset(0, 8, 0);
+		DefineTileset(0, 0, 8);
+		CommandStream def;
+		DefineWindowCmd def_cmd = { 0, 512, 256, 8, 8, 64, 64 };
+		def.Add(SDHR_CMD_DEFINE_WINDOW, def_cmd);
+		Run(def);
+		std::vector<uint8_t> tiles(64 * 64 * 2);
+		std::uniform_int_distribution<int> tile_dist(0, 255);
+		for (size_t t = 0; t < tiles.size(); t += 2) {
+			tiles[t] = 0;
+			tiles[t + 1] = tile_dist(rng);
+		}
+		if (Selected(immediate_label)) {
+			CommandStream stream;
+			UpdateWindowSetImmediateCmd c = { 0, (uint16_t)tiles.size() };
+			stream.Add(SDHR_CMD_UPDATE_WINDOW_SET_IMMEDIATE, c, tiles.data(), tiles.size());
+			RunBench("process_commands", immediate_label, "{\"tiles\":4096}", 64 * 64,
+				[&] { mgr->command_buffer = stream.bytes; },
+				[&] { mgr->ProcessCommands(); });
+		}
+		if (Selected(upload_label)) {
+			std::vector<uint8_t> z = Deflate(tiles);
+			Upload(0, z.data(), z.size());
+			CommandStream stream;
+			UpdateWindowSetUploadCmd c = { 0, (uint16_t)((z.size() + 511) / 512) };
+			stream.Add(SDHR_CMD_UPDATE_WINDOW_SET_UPLOAD, c);
+			RunBench("process_commands", upload_label, "{\"tiles\":4096}", 64 * 64,
+				[&] { mgr->command_buffer = stream.bytes; },
+				[&] { mgr->ProcessCommands(); });
+		}
+	}
+}
+
+void SDHRBench::BenchTileExtraction()
+{
+	static const uint16_t tile_dims[] = { 8, 16, 32 };
+	if (Selected("convert_argb/512x512")) {
+		// the swizzle every decoded asset goes through, 1 MB of pixels
+		std::vector<uint8_t> rgba(512 * 512 * 4);
+		for (size_t i = 0; i < rgba.size(); ++i)
+			rgba[i] = (uint8_t)i;
+		char params[64];
+		snprintf(params, sizeof(params), "{\"kernel\":\"%s\"}", PixelKernelName());
+		RunBench("convert_argb", "convert_argb/512x512", params, 512.0 * 512.0,
+			[] {},
+			[&] { ConvertRGBAToARGB(rgba.data(), 512 * 512); });
+	}
+	std::vector<uint8_t> offsets = TileOffsets();
+	for (uint16_t tile_dim : tile_dims) {
+		char define_label[64];
+		char extract_label[64];
+		snprintf(define_label, sizeof(define_label), "define_tileset/t%u_256", tile_dim);
+		snprintf(extract_label, sizeof(extract_label), "extract_tile/t%u", tile_dim);
+		if (!Selected(define_label) && !Selected(extract_label))
+			continue;
+		Reset();
+		DefineAsset(0, tile_dim, 0);
+		SDHRManager::ImageAsset* asset = mgr->image_assets;
+		char params[64];
+		snprintf(params, sizeof(params), "{\"tile\":%u}", tile_dim);
+		if (Selected(define_label)) {
+			RunBench("define_tileset", define_label, params, 256,
+				[] {},
+				[&] { mgr->DefineTileset(1, 256, tile_dim, tile_dim, asset, offsets.data()); });
+		}
+		if (Selected(extract_label)) {
+			std::vector<uint32_t> tile((size_t)tile_dim * tile_dim);
+			uint32_t i = 0;
+			RunBench("extract_tile", extract_label, params, (double)tile_dim * tile_dim,
+				[&] { ++i; },
+				[&] { asset->ExtractTile(mgr, tile.data(), tile_dim, tile_dim,
+					(i % 16) * tile_dim, ((i / 16) % 16) * tile_dim); });
+		}
+	}
+}
+
+void SDHRBench::BenchInflate()
+{
+	// a tile map (low entropy) and a noisy bitmap
+	std::vector<uint8_t> tilemap(64 * 64 * 2);
+	std::uniform_int_distribution<int> tile_dist(0, 15);
+	for (size_t t = 0; t < tilemap.size(); t += 2) {
+		tilemap[t] = 0;
+		tilemap[t + 1] = tile_dist(rng);
+	}
+	std::vector<uint8_t> bitmap(1024 * 1024);
+	std::uniform_int_distribution<int> noise_dist(0, 7);
+	for (size_t i = 0; i < bitmap.size(); ++i)
+		bitmap[i] = (uint8_t)((i / 64) & 0xff) + noise_dist(rng);
+
+	struct InflateCase {
+		const char* label;
+		const std::vector<uint8_t>* data;
+	} cases[] = {
+		{ "upload_inflate/tilemap_8k", &tilemap },
+		{ "upload_inflate/bitmap_1m", &bitmap },
+	};
+	for (const InflateCase& c : cases) {
+		if (!Selected(c.label))
+			continue;
+		std::vector<uint8_t> z = Deflate(*c.data);
+		char params[128];
+		snprintf(params, sizeof(params), "{\"uncompressed_bytes\":%zu,\"compressed_bytes\":%zu,\"implementation\":\"%s\"}",
+			c.data->size(), z.size(), Inflater::Implementation());
+		std::vector<uint8_t> out(c.data->size());
+		uint64_t out_size = 0;
+		Inflater inflater;
+		RunBench("upload_inflate", c.label, params, (double)c.data->size(),
+			[] {},
+			[&] { inflater.Inflate(z.data(), z.size(), out.data(), out.size(), &out_size); });
+	}
+}
+
+void SDHRBench::BenchPacketDecode()
+{
+	const char* label = "packet_decode/frames_64";
+	if (!Selected(label))
+		return;
+	Reset();
+	DefineAsset(0, 8, 0);
+	DefineTileset(0, 0, 8);
+	DefineWindows(1, 8, false);
+
+	// Per frame: memory writes, one window position command as data packets, PROCESS
+	std::vector<SDHRPacket> packets;
+	std::uniform_int_distribution<int> addr_dist(0x200, 0xbfff);
+	std::uniform_int_distribution<int> byte_dist(0, 255);
+	for (int frame = 0; frame < 64; ++frame) {
+		for (int i = 0; i < 1024; ++i)
+			packets.push_back({ (uint16_t)addr_dist(rng), (uint8_t)byte_dist(rng), 0 });
+		CommandStream s;
+		UpdateWindowSetWindowPositionCmd c = { 0, frame, frame };
+		s.Add(SDHR_CMD_UPDATE_WINDOW_SET_WINDOW_POSITION, c);
+		for (uint8_t b : s.bytes)
+			packets.push_back({ CXSDHR_DATA, b, 0 });
+		packets.push_back({ CXSDHR_CTRL, SDHR_CTRL_PROCESS, 0 });
+	}
+	RunBench("packet_decode", label, "{\"frames\":64,\"memory_writes_per_frame\":1024}", (double)packets.size(),
+		[] {},
+		[&] {
+			for (const SDHRPacket& p : packets)
+				HandleSDHRPacket(mgr, p);
+		});
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Main
+//////////////////////////////////////////////////////////////////////////
+
+static void WriteJSON(FILE* f)
+{
+	fprintf(f, "{\n\"version\":1,\n\"min_time_s\":%g,\n\"results\":[", g_min_time);
+	for (size_t i = 0; i < g_results.size(); ++i) {
+		const BenchResult& r = g_results[i];
+		fprintf(f, "%s\n{\"name\":\"%s\",\"label\":\"%s\",\"params\":%s,\"iterations\":%llu,"
+			"\"items_per_iteration\":%.0f,\"ns_per_iteration\":{\"min\":%.1f,\"median\":%.1f,\"mean\":%.1f,\"max\":%.1f},"
+			"\"ns_per_item\":%.4f}",
+			i ? "," : "", r.name.c_str(), r.label.c_str(), r.params.c_str(), (unsigned long long)r.iterations,
+			r.items_per_iteration, r.ns_min, r.ns_median, r.ns_mean, r.ns_max,
+			r.ns_median / r.items_per_iteration);
+	}
+	fprintf(f, "\n]\n}\n");
+}
+
+int main(int argc, char* argv[])
+{
+	const char* out_path = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+			g_filter = argv[++i];
+		}
+		else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+			g_min_time = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+			out_path = argv[++i];
+		}
+		else {
+			fprintf(stderr, "Usage: %s [--filter <substring>] [--min-time <seconds>] [--out <file>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	SDHRBench bench;
+	bench.BenchDrawWindows();
+	bench.BenchDrawWindowLayers();
+	bench.BenchProcessCommands();
+	bench.BenchTileExtraction();
+	bench.BenchInflate();
+	bench.BenchPacketDecode();
+
+	FILE* f = out_path ? fopen(out_path, "w") : stdout;
+	if (f == NULL) {
+		fprintf(stderr, "cannot write %s: %m\n", out_path);
+		return 1;
+	}
+	WriteJSON(f);
+	if (out_path)
+		fclose(f);
+	return 0;
+}
@@ -0,0 +1,98 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "FrameTiming.h"
+
+/**
+ *
+ * SDHRFrameDump
+ * Reads the frame timing ring that a running SDHRServer keeps in shared memory
+ * and prints the per-stage histograms, the frame counters and the last frames.
+ *
+ * Usage: SDHRFrameDump [-n <frames>]
+ *
+ */
+
+static const char* const FrameStageNames[FRAME_STAGE_COUNT] = {
+	"packet", "proc_start", "proc_end", "rend_start", "rend_end", "flip_submit", "flip_event"
+};
+
+int main(int argc, char* argv[])
+{
+	uint64_t frames_to_show = 16;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			frames_to_show = strtoull(argv[++i], NULL, 10);
+		}
+		else {
+			fprintf(stderr, "Usage: %s [-n <frames>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	int fd = shm_open(FRAMETIMING_SHM_NAME, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "cannot open shared memory %s: %m (is SDHRServer running?)\n", FRAMETIMING_SHM_NAME);
+		return 1;
+	}
+	void* p = mmap(NULL, sizeof(FrameTimingShared), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "cannot map shared memory: %m\n");
+		return 1;
+	}
+	const FrameTimingShared* shared = (const FrameTimingShared*)p;
+	if (shared->magic != FRAMETIMING_MAGIC
+		|| shared->ring_size != FRAMETIMING_RING_SIZE
+		|| shared->histogram_buckets != FRAMETIMING_HISTOGRAM_BUCKETS) {
+		fprintf(stderr, "shared memory layout mismatch, rebuild SDHRFrameDump with the server\n");
+		return 1;
+	}
+
+	printf("frames flipped:    %llu\n", (unsigned long long)shared->frames_flipped.load());
+	printf("batches coalesced: %llu\n", (unsigned long long)shared->batches_coalesced.load());
+	printf("missed vblanks:    %llu\n", (unsigned long long)shared->missed_vblanks.load());
+	printf("\n%-10s %10s %10s %10s %10s %10s\n", "span(us)", "count", "mean", "p50", "p99", "max");
+	for (int i = 0; i < FRAME_SPAN_COUNT; ++i) {
+		const FrameTimingHistogram& h = shared->histograms[i];
+		uint64_t count = h.count.load();
+		printf("%-10s %10llu %10llu %10llu %10llu %10llu\n", FrameSpanNames[i],
+			(unsigned long long)count,
+			(unsigned long long)(count ? h.sum_us.load() / count : 0),
+			(unsigned long long)FrameTimingPercentile(h, 0.50),
+			(unsigned long long)FrameTimingPercentile(h, 0.99),
+			(unsigned long long)h.max_us.load());
+	}
+
+	// last frames, stage times in us relative to the packet receipt
+	uint64_t head = shared->head.load(std::memory_order_acquire);
+	uint64_t first = head > frames_to_show ? head - frames_to_show : 0;
+	if (head - first > FRAMETIMING_RING_SIZE)
+		first = head - FRAMETIMING_RING_SIZE;
+	if (first < head) {
+		printf("\n%8s %8s %7s %6s", "frame", "vblank", "batches", "missed");
+		for (int s = FRAME_STAGE_PROCESS_START; s < FRAME_STAGE_COUNT; ++s)
+			printf(" %11s", FrameStageNames[s]);
+		printf("\n");
+	}
+	for (uint64_t index = first; index < head; ++index) {
+		FrameTimingRecord r;
+		if (!FrameTimingReadRecord(shared, index, &r))
+			continue;
+		printf("%8llu %8u %7u %6u", (unsigned long long)r.frame_id, r.vblank_seq, r.batches, r.missed_vblanks);
+		uint64_t base = r.stamp_ns[FRAME_STAGE_PACKET_RECEIVED];
+		for (int s = FRAME_STAGE_PROCESS_START; s < FRAME_STAGE_COUNT; ++s) {
+			if (base == 0 || r.stamp_ns[s] < base)
+				printf(" %11s", "-");
+			else
+				printf(" %11llu", (unsigned long long)((r.stamp_ns[s] - base) / 1000));
+		}
+		printf("\n");
+	}
+	munmap(p, sizeof(FrameTimingShared));
+	return 0;
+}
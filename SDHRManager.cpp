@@ -1,109 +1,61 @@
 #include "SDHRManager.h"
+#include "Logger.h"
+#include "Trace.h"
+#include "Metrics.h"
+#include "WorkerPool.h"
+#include "XXHash64.h"
+#include "PixelFormat.h"
 #include <cstring>
 #include <zlib.h>
+#if SDHR_USE_LZ4
+#include <lz4.h>
+#endif
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include <algorithm>
+#include <unordered_map>
 #include <chrono>
 
 // below because "The declaration of a static data member in its class definition is not a definition"
 SDHRManager* SDHRManager::s_instance;
 
-//////////////////////////////////////////////////////////////////////////
-// Commands structs
-//////////////////////////////////////////////////////////////////////////
+const char* SDHRManager::CommandName(uint8_t cmd)
+{
+	switch (cmd) {
+	case SDHR_CMD_UPLOAD_DATA: return "UPLOAD_DATA";
+	case SDHR_CMD_DEFINE_IMAGE_ASSET: return "DEFINE_IMAGE_ASSET";
+	case SDHR_CMD_DEFINE_IMAGE_ASSET_FILENAME: return "DEFINE_IMAGE_ASSET_FILENAME";
+	case SDHR_CMD_DEFINE_TILESET: return "DEFINE_TILESET";
+	case SDHR_CMD_DEFINE_TILESET_IMMEDIATE: return "DEFINE_TILESET_IMMEDIATE";
+	case SDHR_CMD_DEFINE_WINDOW: return "DEFINE_WINDOW";
+	case SDHR_CMD_UPDATE_WINDOW_SET_IMMEDIATE: return "UPDATE_WINDOW_SET_IMMEDIATE";
+	case SDHR_CMD_UPDATE_WINDOW_SHIFT_TILES: return "UPDATE_WINDOW_SHIFT_TILES";
+	case SDHR_CMD_UPDATE_WINDOW_SET_WINDOW_POSITION: return "UPDATE_WINDOW_SET_WINDOW_POSITION";
+	case SDHR_CMD_UPDATE_WINDOW_ADJUST_WINDOW_VIEW: return "UPDATE_WINDOW_ADJUST_WINDOW_VIEW";
+	case SDHR_CMD_UPDATE_WINDOW_SET_BITMASKS: return "UPDATE_WINDOW_SET_BITMASKS";
+	case SDHR_CMD_UPDATE_WINDOW_ENABLE: return "UPDATE_WINDOW_ENABLE";
+	case SDHR_CMD_READY: return "READY";
+	case SDHR_CMD_UPLOAD_DATA_FILENAME: return "UPLOAD_DATA_FILENAME";
+	case SDHR_CMD_UPDATE_WINDOW_SET_UPLOAD: return "UPDATE_WINDOW_SET_UPLOAD";
+	case SDHR_CMD_UPDATE_WINDOW_SET_PALETTE: return "UPDATE_WINDOW_SET_PALETTE";
+	case SDHR_CMD_COMPRESSED: return "COMPRESSED";
+	case SDHR_CMD_UPDATE_WINDOW_SET_RUNS: return "UPDATE_WINDOW_SET_RUNS";
+	case SDHR_CMD_UPDATE_WINDOW_SET_REGION: return "UPDATE_WINDOW_SET_REGION";
+	case SDHR_CMD_UPDATE_WINDOW_SHIFT_TILES_BY: return "UPDATE_WINDOW_SHIFT_TILES_BY";
+	default: return "UNKNOWN_COMMAND";
+	}
+}
 
-#pragma pack(push)
-#pragma pack(1)
-
-struct UploadDataCmd {
-	uint16_t dest_block;
-	uint16_t source_addr;
-};
-
-struct UploadDataFilenameCmd {
-	uint8_t dest_addr_med;
-	uint8_t dest_addr_high;
-	uint8_t filename_length;
-	uint8_t filename[];
-};
-
-struct DefineImageAssetCmd {
-	uint8_t asset_index;
-	uint16_t block_count;
-};
-
-struct DefineImageAssetFilenameCmd {
-	uint8_t asset_index;
-	uint8_t filename_length;
-	uint8_t filename[];  // don't include the trailing null either in the data or counted in the filename_length
-};
-
-struct DefineTilesetCmd {
-	uint8_t tileset_index;
-	uint8_t asset_index;
-	uint8_t num_entries;
-	uint16_t xdim;
-	uint16_t ydim;
-	uint16_t block_count;
-};
-
-struct DefineTilesetImmediateCmd {
-	uint8_t tileset_index;
-	uint8_t num_entries;
-	uint8_t xdim;
-	uint8_t ydim;
-	uint8_t asset_index;
-	uint8_t data[];  // data is 4-byte records, 16-bit x and y offsets (scaled by x/ydim), from the given asset
-};
-
-struct DefineWindowCmd {
-	uint8_t window_index;
-	uint16_t screen_xcount;		// width in pixels of visible screen area of window
-	uint16_t screen_ycount;
-	uint16_t tile_xdim;			// xy dimension, in pixels, of tiles in the window.
-	uint16_t tile_ydim;
-	uint16_t tile_xcount;		// xy dimension, in tiles, of the tile array
-	uint16_t tile_ycount;
-};
-
-struct UpdateWindowSetImmediateCmd {
-	uint8_t window_index;
-	uint16_t data_length;
-};
-
-struct UpdateWindowSetUploadCmd {
-	uint8_t window_index;
-	uint16_t block_count;
-};
-
-struct UpdateWindowShiftTilesCmd {
-	uint8_t window_index;
-	int8_t x_dir; // +1 shifts tiles right by 1, negative shifts tiles left by 1, zero no change
-	int8_t y_dir; // +1 shifts tiles down by 1, negative shifts tiles up by 1, zero no change
-};
-
-struct UpdateWindowSetWindowPositionCmd {
-	uint8_t window_index;
-	int32_t screen_xbegin;
-	int32_t screen_ybegin;
-};
-
-struct UpdateWindowAdjustWindowViewCommand {
-	uint8_t window_index;
-	int32_t tile_xbegin;
-	int32_t tile_ybegin;
-};
-
-struct UpdateWindowEnableCmd {
-	uint8_t window_index;
-	uint8_t enabled;
-};
-
-#pragma pack(pop)
+// The asset, tileset or window a command works on, for tracing
+static int64_t CommandTargetIndex(uint8_t cmd, const uint8_t* p, const uint8_t* end)
+{
+	if (cmd == SDHR_CMD_UPLOAD_DATA && end - p >= 2)
+		return *((uint16_t*)p);	// dest_block
+	return (p < end) ? *p : -1;
+}
 
 //////////////////////////////////////////////////////////////////////////
 // Image Asset Methods
@@ -113,28 +65,57 @@ void SDHRManager::ImageAsset::AssignByFilename(const char* filename) {
 	int width;
 	int height;
 	int channels;
-	data = stbi_load(filename, &width, &height, &channels, 4);
-	if (data == NULL) {
+	Free();
+	uint8_t* decoded = stbi_load(filename, &width, &height, &channels, 4);
+	if (decoded == NULL) {
 		// image failed to load
 		SDHRManager::GetInstance()->error_flag = true;
 		return;
 	}
+	ConvertRGBAToARGB(decoded, (uint64_t)width * height);
+	auto p = std::make_shared<ImagePixels>();
+	p->data = decoded;
+	p->xcount = width;
+	p->ycount = height;
+	pixels = p;
+	data = decoded;
 	image_xcount = width;
 	image_ycount = height;
 }
 
-void SDHRManager::ImageAsset::AssignByMemory(SDHRManager* owner, const uint8_t* buffer, uint64_t size) {
-	int width;
-	int height;
-	int channels;
-	data = stbi_load_from_memory(buffer, size, &width, &height, &channels, 4);
-	if (data == NULL) {
-		owner->CommandError(stbi_failure_reason());
-		owner->error_flag = true;
-		return;
+void SDHRManager::ImageAsset::AssignByMemory(std::vector<uint8_t>&& buffer) {
+	Free();
+	pending = AssetCache::GetInstance()->Decode(std::move(buffer), &key);
+}
+
+bool SDHRManager::ImageAsset::Resolve(SDHRManager* owner) {
+	if (!pending.valid())
+		return true;
+	DecodedImage decoded;
+	{
+		SDHR_TRACE_SCOPE("asset_wait");
+		decoded = pending.get();
 	}
-	image_xcount = width;
-	image_ycount = height;
+	pending = std::shared_future<DecodedImage>();
+	if (!decoded.pixels) {
+		owner->CommandError(decoded.error ? decoded.error : "image decode failed");
+		return false;
+	}
+	pixels = decoded.pixels;
+	data = pixels->data;
+	image_xcount = pixels->xcount;
+	image_ycount = pixels->ycount;
+	return true;
+}
+
+void SDHRManager::ImageAsset::Free() {
+	// an in-flight decode goes on, the cache keeps its result
+	pending = std::shared_future<DecodedImage>();
+	pixels.reset();
+	data = NULL;
+	key = 0;
+	image_xcount = 0;
+	image_ycount = 0;
 }
 
 void SDHRManager::ImageAsset::ExtractTile(SDHRManager* owner, uint32_t* tile_p, uint16_t tile_xdim, uint16_t tile_ydim, uint64_t xsource, uint64_t ysource) {
@@ -146,82 +127,27 @@ void SDHRManager::ImageAsset::ExtractTile(SDHRManager* owner, uint32_t* tile_p,
 		return;
 	}
 
+	// the asset is already in the tile format, copy row by row
+	const uint32_t* source_p = (const uint32_t*)data + ysource * image_xcount + xsource;
 	for (uint64_t y = 0; y < tile_ydim; ++y) {
-		uint64_t source_yoffset = (ysource + y) * image_xcount * 4;
-		for (uint64_t x = 0; x < tile_xdim; ++x) {
-			uint64_t pixel_offset = source_yoffset + (xsource + x) * 4;
-			uint8_t r = data[pixel_offset];
-			uint8_t g = data[pixel_offset + 1];
-			uint8_t b = data[pixel_offset + 2];
-			uint8_t a = data[pixel_offset + 3];
-			uint32_t dest_pixel = (((uint32_t)a) << 24) + (((uint32_t)r) << 16) + (((uint32_t)g) << 8) + b;
-			//dest_pixel |= (a & 0x80) ? 0x8000 : 0x0;
-			//dest_pixel |= (r >> 3) << 10;
-			//dest_pixel |= (g >> 3) << 5;
-			//dest_pixel |= (b >> 3);
-			*dest_p = dest_pixel;
-			++dest_p;
-		}
+		memcpy(dest_p, source_p, (size_t)tile_xdim * sizeof(uint32_t));
+		source_p += image_xcount;
+		dest_p += tile_xdim;
 	}
 }
 
-//////////////////////////////////////////////////////////////////////////
-// Static Methods
-//////////////////////////////////////////////////////////////////////////
-
-int upload_inflate(const char* source, uint64_t size, std::ostream& dest) {
-	static const int CHUNK = 16384;
-	int ret;
-	unsigned have;
-	z_stream strm;
-	unsigned char in[CHUNK];
-	unsigned char out[CHUNK];
-
-	/* allocate inflate state */
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.avail_in = 0;
-	strm.next_in = Z_NULL;
-	ret = inflateInit2(&strm, (15 + 32));
-	if (ret != Z_OK)
-		return ret;
-
-	/* decompress until deflate stream ends or end of file */
-	uint64_t bytes_read = 0;
-	while (bytes_read < size) {
-		uint64_t bytes_to_read = std::min((uint64_t)CHUNK, size - bytes_read);
-		memcpy(in, source + bytes_read, bytes_to_read);
-		bytes_read += bytes_to_read;
-		strm.avail_in = bytes_to_read;
-		if (strm.avail_in == 0)
-			break;
-		strm.next_in = in;
-
-		/* run inflate() on input until output buffer not full */
-		do {
-			strm.avail_out = CHUNK;
-			strm.next_out = out;
-			ret = inflate(&strm, Z_NO_FLUSH);
-			assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-			switch (ret) {
-			case Z_NEED_DICT:
-				ret = Z_DATA_ERROR;     /* and fall through */
-			case Z_DATA_ERROR:
-			case Z_MEM_ERROR:
-				(void)inflateEnd(&strm);
-				return ret;
-			}
-			have = CHUNK - strm.avail_out;
-			dest.write((char*)out, have);
-		} while (strm.avail_out == 0);
-
-		/* done when inflate() says it's done */
-	} while (ret != Z_STREAM_END);
-
-	/* clean up and return */
-	(void)inflateEnd(&strm);
-	return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
+void SDHRManager::ImageAsset::ExtractIndexedTile(SDHRManager* owner, uint8_t* tile_p, uint16_t tile_xdim, uint16_t tile_ydim, uint64_t xsource, uint64_t ysource) {
+	if (xsource + tile_xdim > image_xcount ||
+		ysource + tile_ydim > image_ycount) {
+		owner->CommandError("ExtractTile out of bounds");
+		return;
+	}
+	const uint8_t* source_p = pixels->indices.data() + ysource * image_xcount + xsource;
+	for (uint64_t y = 0; y < tile_ydim; ++y) {
+		memcpy(tile_p, source_p, tile_xdim);
+		source_p += image_xcount;
+		tile_p += tile_xdim;
+	}
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -233,10 +159,22 @@ void SDHRManager::Initialize()
 	m_bEnabled = false;
 	error_flag = false;
 	memset(error_str, 0, sizeof(error_str));
-	memset(uploaded_data_region, 0, sizeof(uploaded_data_region));
-	*image_assets = {};
-	*tileset_records = {};
-	*windows = {};
+	if (upload_mapping.base == NULL && !upload_mapping.Map(uploaded_data_region_size, METRIC_REGION_UPLOAD))
+		throw std::bad_alloc();
+	upload_mapping.Zero();
+	uploaded_data_region = upload_mapping.base;
+	FreeAllocations();
+	for (uint16_t i = 0; i < 256; ++i) {
+		image_assets[i] = {};
+		tileset_records[i] = {};
+		windows[i] = {};
+	}
+	enabled_windows.clear();
+	for (uint16_t i = 0; i < 256; ++i) {
+		DropLayer(render_plans + i);
+		render_plans[i].stale = RENDER_PLAN_GEOMETRY | RENDER_PLAN_TILES;
+	}
+	Metrics::SetGauge(METRIC_GAUGE_TILESET_BYTES, 0);
 
 	command_buffer.clear();
 	command_buffer.reserve(64 * 1024);
@@ -245,28 +183,37 @@ void SDHRManager::Initialize()
 	// Whenever memory is written from the Apple2
 	// in the main bank between $200 and $BFFF it will
 	// be sent through the socket and this buffer will be updated
-	if (a2mem == NULL)
-		a2mem = new uint8_t[0xbfff];	// anything below $200 is unused
-	memset(a2mem, 0, 0xbfff);
+	// anything below $200 is unused
+	if (a2mem_mapping.base == NULL && !a2mem_mapping.Map(0xc000, METRIC_REGION_APPLE2_MEMORY))
+		throw std::bad_alloc();
+	a2mem_mapping.Zero();
+	a2mem = a2mem_mapping.base;
 }
 
 SDHRManager::~SDHRManager()
+{
+	FreeAllocations();
+	a2mem_mapping.Unmap();
+	upload_mapping.Unmap();
+}
+
+void SDHRManager::FreeAllocations()
 {
 	for (uint16_t i = 0; i < 256; ++i) {
-		if (image_assets[i].data) {
-			stbi_image_free(image_assets[i].data);
-		}
-		if (tileset_records[i].tile_data) {
-			free(tileset_records[i].tile_data);
-		}
+		image_assets[i].Free();
+		tileset_records[i].Free();
+		tile_atlas.Free(tileset_records[i].atlas_slot);
 		if (windows[i].tilesets) {
 			free(windows[i].tilesets);
+			windows[i].tilesets = NULL;
 		}
 		if (windows[i].tile_indexes) {
 			free(windows[i].tile_indexes);
+			windows[i].tile_indexes = NULL;
 		}
+		free(windows[i].palette);
+		windows[i].palette = NULL;
 	}
-	delete[] a2mem;
 }
 
 void SDHRManager::AddPacketDataToBuffer(uint8_t data)
@@ -282,7 +229,8 @@ void SDHRManager::ClearBuffer()
 void SDHRManager::CommandError(const char* err) {
 	strcpy(error_str, err);
 	error_flag = true;
-	std::cerr << "Command Error: " << error_str << std::endl;
+	Metrics::Add(METRIC_COMMAND_ERRORS);
+	SDHR_LOG_ERROR("Command Error: %s", error_str);
 }
 
 bool SDHRManager::CheckCommandLength(uint8_t* p, uint8_t* e, size_t sz) {
@@ -314,21 +262,99 @@ uint8_t* SDHRManager::GetApple2MemPtr()
 	return a2mem;
 }
 
-void SDHRManager::DefineTileset(uint8_t tileset_index, uint16_t num_entries, uint8_t xdim, uint8_t ydim,
+// Same asset, tile size, offsets and storage flags give the same stored tiles
+static uint64_t TilesetKey(uint64_t asset_key, uint8_t xdim, uint8_t ydim, uint16_t num_entries, const uint8_t* offsets,
+	bool dedup, bool indexed)
+{
+	uint64_t dims[4] = { xdim, ydim, num_entries, (uint64_t)dedup | ((uint64_t)indexed << 1) };
+	uint64_t seed = XXHash64(dims, sizeof(dims), asset_key);
+	return XXHash64(offsets, (size_t)num_entries * 4, seed);
+}
+
+bool SDHRManager::DefineTileset(uint8_t tileset_index, uint16_t num_entries, uint8_t xdim, uint8_t ydim,
 	ImageAsset* asset, uint8_t* offsets) {
-	uint64_t store_data_size = (uint64_t)xdim * ydim * sizeof(uint32_t) * num_entries;
+	SDHR_TRACE_SCOPE("DefineTileset", "tileset", tileset_index, "entries", num_entries);
+	uint64_t tile_pixels = (uint64_t)xdim * ydim;
 	TilesetRecord* r = tileset_records + tileset_index;
-	if (r->tile_data) {
-		free(r->tile_data);
+	TileAtlasHandle slot = r->atlas_slot;	// reused in place if the tile size stays the same
+	for (uint16_t i = 0; i < 256; ++i) {
+		render_plans[i].stale |= RENDER_PLAN_TILES | RENDER_PLAN_LAYER;	// they point at the old tiles
+		// a window palette was copied from the old tiles' colours
+		if (windows[i].palette && windows[i].palette_tileset == tileset_index) {
+			free(windows[i].palette);
+			windows[i].palette = NULL;
+		}
 	}
+	r->Free();
 	*r = {};
 	r->xdim = xdim;
 	r->ydim = ydim;
 	r->num_entries = num_entries;
-	r->tile_data = (uint32_t*)malloc(store_data_size);
+
+	// Tiles extracted before, possibly by a previous run, don't need the asset at all.
+	// The file has the tiles and the tile map, then the palette for indexed tiles.
+	DiskCache* disk_cache = DiskCache::GetInstance();
+	uint64_t key = 0;
+	if (asset->key && disk_cache->IsEnabled()) {
+		key = TilesetKey(asset->key, xdim, ydim, num_entries, offsets, tile_dedup, indexed_tiles);
+		if (disk_cache->Load(DISK_CACHE_TILESET, key, r->tile_mapping)) {
+			const DiskCacheHeader* h = r->tile_mapping.Header();
+			uint8_t* block = r->tile_mapping.Data();
+			bool indexed = (h->params[3] >> 32) == 1;
+			if (indexed)
+				r->index_data = block;
+			else
+				r->tile_data = (uint32_t*)block;
+			r->num_bitmaps = (uint32_t)h->params[3];
+			uint64_t tiles_bytes = tile_pixels * r->BytesPerPixel() * r->num_bitmaps;
+			bool valid = h->params[0] == xdim && h->params[1] == ydim && h->params[2] == num_entries
+				&& r->num_bitmaps <= num_entries
+				&& h->data_bytes == r->Bytes() + (indexed ? sizeof(r->palette) : 0);
+			if (valid) {
+				r->tile_map = (uint16_t*)(block + tiles_bytes);
+				for (uint64_t i = 0; i < num_entries && valid; ++i)
+					valid = r->tile_map[i] < r->num_bitmaps;
+				if (indexed)
+					memcpy(r->palette, block + r->Bytes(), sizeof(r->palette));
+			}
+			if (valid) {
+				tile_atlas.Free(slot);
+				Metrics::Add(METRIC_DISK_CACHE_HITS);
+				UpdateTilesetGauge();
+				return true;
+			}
+			r->Free();
+			r->num_bitmaps = 0;
+		}
+	}
+
+	if (!asset->Resolve(this)) {
+		tile_atlas.Free(slot);
+		return false;
+	}
+	bool indexed = indexed_tiles && asset->HasPalette();
+	uint64_t tile_bytes = tile_pixels * (indexed ? 1 : sizeof(uint32_t));
+	// room for every entry, trimmed once the duplicates are known
+	r->atlas_slot = tile_atlas.Allocate(tile_bytes, num_entries, slot);
+	uint8_t* block = tile_atlas.Data(r->atlas_slot);
+	if (block == NULL) {
+		CommandError("cannot allocate tileset memory");
+		return false;
+	}
+	if (indexed) {
+		r->index_data = block;
+		memcpy(r->palette, asset->pixels->palette.data(), asset->pixels->palette.size() * sizeof(uint32_t));
+	}
+	else {
+		r->tile_data = (uint32_t*)block;
+	}
+	std::vector<uint16_t> tile_map(num_entries);
+	std::unordered_map<uint64_t, uint16_t> bitmaps_by_hash;
+	if (tile_dedup)
+		bitmaps_by_hash.reserve(num_entries);
 
 	uint8_t* offset_p = offsets;
-	uint32_t* dest_p = r->tile_data;
+	uint8_t* dest_p = block;
 	for (uint64_t i = 0; i < num_entries; ++i) {
 		uint64_t xoffset = *((uint16_t*)offset_p);
 		offset_p += 2;
@@ -336,9 +362,296 @@ void SDHRManager::DefineTileset(uint8_t tileset_index, uint16_t num_entries, uin
 		offset_p += 2;
 		uint64_t asset_xoffset = xoffset * xdim;
 		uint64_t asset_yoffset = yoffset * xdim;
-		asset->ExtractTile(this, dest_p, xdim, ydim, asset_xoffset, asset_yoffset);
-		dest_p += (uint64_t)xdim * ydim;
+		if (indexed)
+			asset->ExtractIndexedTile(this, dest_p, xdim, ydim, asset_xoffset, asset_yoffset);
+		else
+			asset->ExtractTile(this, (uint32_t*)dest_p, xdim, ydim, asset_xoffset, asset_yoffset);
+		if (tile_dedup) {
+			// a hash collision with different pixels just stores the tile again
+			uint64_t hash = XXHash64(dest_p, tile_bytes);
+			auto it = bitmaps_by_hash.find(hash);
+			if (it != bitmaps_by_hash.end()
+				&& memcmp(block + it->second * tile_bytes, dest_p, tile_bytes) == 0) {
+				tile_map[i] = it->second;
+				continue;
+			}
+			bitmaps_by_hash.emplace(hash, (uint16_t)r->num_bitmaps);
+		}
+		tile_map[i] = (uint16_t)r->num_bitmaps++;
+		dest_p += tile_bytes;
+	}
+	SDHR_LOG_DEBUG("DefineTileset: %u entries, %llu distinct %s tiles", (uint32_t)num_entries,
+		(unsigned long long)r->num_bitmaps, indexed ? "indexed" : "ARGB");
+	if (r->num_bitmaps < num_entries)
+		Metrics::Add(METRIC_TILES_DEDUPLICATED, num_entries - r->num_bitmaps);
+	r->tile_map = (uint16_t*)(block + tile_bytes * r->num_bitmaps);
+	memcpy(r->tile_map, tile_map.data(), num_entries * sizeof(uint16_t));
+	tile_atlas.Trim(r->atlas_slot, r->Bytes());
+	UpdateTilesetGauge();
+	if (error_flag)
+		return false;
+
+	if (key) {
+		// written by a worker, from a copy since the tileset can be redefined meanwhile
+		Metrics::Add(METRIC_DISK_CACHE_MISSES);
+		auto tiles = std::make_shared<std::vector<uint8_t>>(block, block + r->Bytes());
+		if (indexed)
+			tiles->insert(tiles->end(), (uint8_t*)r->palette, (uint8_t*)r->palette + sizeof(r->palette));
+		uint64_t params[4] = { xdim, ydim, num_entries, r->num_bitmaps | ((uint64_t)(indexed ? 1 : 0) << 32) };
+		WorkerPool::GetInstance()->Submit([tiles, key, params]() {
+			DiskCache::GetInstance()->Store(DISK_CACHE_TILESET, key, params, tiles->data(), tiles->size());
+		});
+	}
+	return true;
+}
+
+void SDHRManager::WindowTileLimits(const Window* w, uint16_t limits[256])
+{
+	// entries per tileset of the window's tile size, 0 for the others
+	for (uint16_t i = 0; i < 256; ++i) {
+		const TilesetRecord& t = tileset_records[i];
+		limits[i] = (t.xdim == w->tile_xdim && t.ydim == w->tile_ydim) ? (uint16_t)t.num_entries : 0;
+	}
+}
+
+// Checks tileset/index pairs against WindowTileLimits, without branches
+static bool ValidTileEntries(const uint16_t limits[256], const uint8_t* entries, uint64_t count)
+{
+	uint32_t bad = 0;
+	for (uint64_t i = 0; i < count; ++i)
+		bad |= (uint32_t)(entries[i * 2 + 1] >= limits[entries[i * 2]]);
+	return bad == 0;
+}
+
+void SDHRManager::ScatterTiles(Window* w, uint64_t first, const uint8_t* entries, uint64_t count)
+{
+	uint8_t* tilesets = w->tilesets + first;
+	uint8_t* tile_indexes = w->tile_indexes + first;
+	for (uint64_t i = 0; i < count; ++i) {
+		tilesets[i] = entries[i * 2];
+		tile_indexes[i] = entries[i * 2 + 1];
+	}
+}
+
+// Moves one tile plane (tilesets or tile indexes) of a window by dx, dy tiles.
+// Exposed tiles get fill, or repeat the edge like repeated 1 tile shifts if fill is NULL.
+static void ShiftTilePlane(uint8_t* plane, int64_t xcount, int64_t ycount, int64_t dx, int64_t dy, const uint8_t* fill)
+{
+	dx = std::max(-xcount, std::min(xcount, dx));
+	dy = std::max(-ycount, std::min(ycount, dy));
+	uint64_t kept = xcount - (dx < 0 ? -dx : dx);
+	// going away from the shift direction, so every source row is read before it's overwritten
+	for (int64_t i = 0; i < ycount; ++i) {
+		int64_t y = dy > 0 ? ycount - 1 - i : i;
+		uint8_t* dest = plane + y * xcount;
+		int64_t src_y = y - dy;
+		if (fill && (src_y < 0 || src_y >= ycount)) {
+			memset(dest, *fill, xcount);
+			continue;
+		}
+		const uint8_t* src = plane + std::max((int64_t)0, std::min(ycount - 1, src_y)) * xcount;
+		uint8_t left = fill ? *fill : src[0];
+		uint8_t right = fill ? *fill : src[xcount - 1];
+		if (dx >= 0) {
+			memmove(dest + dx, src, kept);
+			memset(dest, left, dx);
+		}
+		else {
+			memmove(dest, src - dx, kept);
+			memset(dest + kept, right, -dx);
+		}
+	}
+}
+
+void SDHRManager::SetWindowEnabled(uint8_t window_index, bool enabled)
+{
+	windows[window_index].enabled = enabled;
+	auto it = std::lower_bound(enabled_windows.begin(), enabled_windows.end(), window_index);
+	bool listed = it != enabled_windows.end() && *it == window_index;
+	if (enabled && !listed)
+		enabled_windows.insert(it, window_index);
+	else if (!enabled && listed)
+		enabled_windows.erase(it);
+}
+
+// Wraps v into [0, span)
+static uint32_t WrapInto(int64_t v, int64_t span)
+{
+	v %= span;
+	return (uint32_t)(v < 0 ? v + span : v);
+}
+
+void SDHRManager::InvalidateRenderPlan(uint8_t window_index, uint8_t parts)
+{
+	if (parts & RENDER_PLAN_TILES)
+		parts |= RENDER_PLAN_LAYER;
+	render_plans[window_index].stale |= parts;
+}
+
+void SDHRManager::BuildPlanGeometry(uint8_t window_index)
+{
+	RenderPlan* plan = render_plans + window_index;
+	WindowDraw* d = &plan->draw;
+	const Window* w = windows + window_index;
+	plan->visible = false;
+	plan->row_entries.clear();
+	plan->row_pixels.clear();
+	plan->column_runs.clear();
+	int64_t tile_xspan = w->tile_xcount * w->tile_xdim;
+	int64_t tile_yspan = w->tile_ycount * w->tile_ydim;
+	if (tile_xspan == 0 || tile_yspan == 0)
+		return;
+	int64_t xbegin = std::max(w->screen_xbegin, (int64_t)0);
+	int64_t ybegin = std::max(w->screen_ybegin, (int64_t)0);
+	int64_t xend = std::min(w->screen_xbegin + (int64_t)w->screen_xcount, (int64_t)screen_xcount);
+	int64_t yend = std::min(w->screen_ybegin + (int64_t)w->screen_ycount, (int64_t)screen_ycount);
+	if (xbegin >= xend || ybegin >= yend)
+		return;
+	d->clip_xbegin = (int32_t)xbegin;
+	d->clip_ybegin = (int32_t)ybegin;
+	d->clip_xend = (int32_t)xend;
+	d->clip_yend = (int32_t)yend;
+	d->tile_xorigin = WrapInto(w->tile_xbegin - w->screen_xbegin, tile_xspan);
+	d->tile_yorigin = WrapInto(w->tile_ybegin - w->screen_ybegin, tile_yspan);
+	d->tile_xspan = (uint32_t)tile_xspan;
+	d->tile_yspan = (uint32_t)tile_yspan;
+	d->tile_xdim = (uint16_t)w->tile_xdim;
+	d->tile_ydim = (uint16_t)w->tile_ydim;
+	d->tile_xcount = (uint16_t)w->tile_xcount;
+	d->layer_xoffset = (int32_t)(xbegin - w->screen_xbegin);
+	d->layer_yoffset = (int32_t)(ybegin - w->screen_ybegin);
+
+	// each visible row comes from one row of one tile row
+	for (int32_t screen_y = d->clip_ybegin; screen_y < d->clip_yend; ++screen_y) {
+		uint32_t adj_tile_y = ((uint32_t)screen_y + d->tile_yorigin) % d->tile_yspan;
+		plan->row_entries.push_back(adj_tile_y / d->tile_ydim * d->tile_xcount);
+		plan->row_pixels.push_back(adj_tile_y % d->tile_ydim * d->tile_xdim);
+	}
+	// and the row is cut into runs that stay within one tile column
+	for (int32_t screen_x = d->clip_xbegin; screen_x < d->clip_xend;) {
+		uint32_t adj_tile_x = ((uint32_t)screen_x + d->tile_xorigin) % d->tile_xspan;
+		ColumnRun run;
+		run.screen_x = (uint16_t)screen_x;
+		run.tile_xindex = (uint16_t)(adj_tile_x / d->tile_xdim);
+		run.tile_xoffset = (uint16_t)(adj_tile_x % d->tile_xdim);
+		run.count = (uint16_t)std::min((int32_t)(d->tile_xdim - run.tile_xoffset), d->clip_xend - screen_x);
+		plan->column_runs.push_back(run);
+		screen_x += run.count;
+	}
+	plan->visible = true;
+}
+
+void SDHRManager::BuildPlanTiles(uint8_t window_index)
+{
+	RenderPlan* plan = render_plans + window_index;
+	const Window* w = windows + window_index;
+	uint64_t tile_count = w->tilesets ? w->tile_xcount * w->tile_ycount : 0;
+	plan->tiles.resize(tile_count);
+	for (uint64_t e = 0; e < tile_count; ++e) {
+		const TilesetRecord* t = tileset_records + w->tilesets[e];
+		uint64_t tile_index = w->tile_indexes[e];
+		TileRef& ref = plan->tiles[e];
+		ref.pixels = NULL;
+		ref.palette = NULL;
+		// a tileset redefined since with another size draws nothing
+		if (!t->IsDefined() || tile_index >= t->num_entries || t->xdim != w->tile_xdim || t->ydim != w->tile_ydim)
+			continue;
+		if (t->index_data) {
+			ref.pixels = t->IndexedTile(tile_index);
+			// other tilesets index their own colours, in another order
+			ref.palette = (w->palette && w->tilesets[e] == w->palette_tileset) ? w->palette : t->palette;
+		}
+		else {
+			ref.pixels = (const uint8_t*)t->Tile(tile_index);
+		}
+	}
+}
+
+bool SDHRManager::BuildLayer(uint8_t window_index)
+{
+	RenderPlan* plan = render_plans + window_index;
+	const Window* w = windows + window_index;
+	uint64_t pixel_count = w->screen_xcount * w->screen_ycount;
+	uint64_t bytes = pixel_count * sizeof(uint32_t);
+	if (layer_cache_bytes + bytes > layer_cache_budget)
+		return false;
+	SDHR_TRACE_SCOPE("build_layer", "window", window_index);
+	const WindowDraw* d = &plan->draw;
+	plan->layer.resize(pixel_count);
+	plan->layer_runs.clear();
+	plan->layer_rows.clear();
+	for (uint64_t y = 0; y < w->screen_ycount; ++y) {
+		plan->layer_rows.push_back((uint32_t)plan->layer_runs.size());
+		uint32_t adj_tile_y = WrapInto(w->tile_ybegin + (int64_t)y, d->tile_yspan);
+		const TileRef* row_tiles = plan->tiles.data() + adj_tile_y / d->tile_ydim * d->tile_xcount;
+		uint32_t row_pixel = adj_tile_y % d->tile_ydim * d->tile_xdim;
+		uint32_t adj_tile_x = WrapInto(w->tile_xbegin, d->tile_xspan);
+		uint32_t* dest = plan->layer.data() + y * w->screen_xcount;
+		LayerRun run = { 0, 0 };
+		for (uint64_t x = 0; x < w->screen_xcount; ++x) {
+			const TileRef& ref = row_tiles[adj_tile_x / d->tile_xdim];
+			uint32_t pixel = row_pixel + adj_tile_x % d->tile_xdim;
+			uint32_t colour = 0;
+			if (ref.palette)
+				colour = ref.palette[ref.pixels[pixel]];
+			else if (ref.pixels)
+				colour = ((const uint32_t*)ref.pixels)[pixel];
+			dest[x] = colour;
+			if (colour & 0xFF000000) {
+				if (run.count == 0)
+					run.x = (uint16_t)x;
+				++run.count;
+			}
+			else if (run.count) {
+				plan->layer_runs.push_back(run);
+				run.count = 0;
+			}
+			if (++adj_tile_x == d->tile_xspan)
+				adj_tile_x = 0;
+		}
+		if (run.count)
+			plan->layer_runs.push_back(run);
+	}
+	plan->layer_rows.push_back((uint32_t)plan->layer_runs.size());
+	plan->has_layer = true;
+	layer_cache_bytes += bytes;
+	Metrics::SetGauge(METRIC_GAUGE_LAYER_CACHE_BYTES, layer_cache_bytes);
+	return true;
+}
+
+void SDHRManager::DropLayer(RenderPlan* plan)
+{
+	plan->steady_frames = 0;
+	if (!plan->has_layer)
+		return;
+	layer_cache_bytes -= plan->layer.size() * sizeof(uint32_t);
+	Metrics::SetGauge(METRIC_GAUGE_LAYER_CACHE_BYTES, layer_cache_bytes);
+	plan->has_layer = false;
+	std::vector<uint32_t>().swap(plan->layer);
+	std::vector<LayerRun>().swap(plan->layer_runs);
+	std::vector<uint32_t>().swap(plan->layer_rows);
+}
+
+bool SDHRManager::SetWindowTiles(Window* w, const uint8_t* entries, uint64_t tile_count)
+{
+	uint16_t limits[256];
+	WindowTileLimits(w, limits);
+	// validate everything first, so a bad map leaves the window untouched
+	if (!ValidTileEntries(limits, entries, tile_count))
+		return false;
+	ScatterTiles(w, 0, entries, tile_count);
+	return true;
+}
+
+void SDHRManager::UpdateTilesetGauge()
+{
+	uint64_t tileset_bytes = 0;
+	for (uint16_t i = 0; i < 256; ++i) {
+		if (tileset_records[i].IsDefined())
+			tileset_bytes += tileset_records[i].Bytes();
 	}
+	Metrics::SetGauge(METRIC_GAUGE_TILESET_BYTES, tileset_bytes);
+	Metrics::SetGauge(METRIC_GAUGE_TILE_ATLAS_BYTES, tile_atlas.ReservedBytes());
 }
 
 /**
@@ -362,14 +675,24 @@ bool SDHRManager::ProcessCommands(void)
 	}
 	uint8_t* begin = &command_buffer[0];
 	uint8_t* end = begin + command_buffer.size();
-	uint8_t* p = begin;
+	SDHR_TRACE_SCOPE("ProcessCommands", "bytes", (int64_t)command_buffer.size());
 
 	// std::cerr << "Command buffer size: " << command_buffer.size() << std::endl;
 
+	if (!ExecuteCommands(begin, end))
+		return false;
+	// we're ready to draw
+	command_buffer.clear();
+	return true;
+}
+
+bool SDHRManager::ExecuteCommands(uint8_t* begin, uint8_t* end)
+{
+	uint8_t* p = begin;
 	while (p < end) {
 		// Header (2 bytes) giving the size in bytes of the command
 		if (!CheckCommandLength(p, end, 2)) {
-			std::cerr << "CheckCommandLength failed!" << std::endl;
+			SDHR_LOG_ERROR("CheckCommandLength failed!");
 			return false;
 		}
 		uint16_t message_length = *((uint16_t*)p);
@@ -377,6 +700,8 @@ bool SDHRManager::ProcessCommands(void)
 		p += 2;
 		// Command ID (1 byte)
 		uint8_t cmd = *p++;
+		SDHR_TRACE_SCOPE(CommandName(cmd), "cmd", cmd, "index", CommandTargetIndex(cmd, p, end));
+		Metrics::CountCommand(cmd);
 		// Command data (variable)
 		switch (cmd) {
 		case SDHR_CMD_UPLOAD_DATA: {
@@ -385,16 +710,12 @@ bool SDHRManager::ProcessCommands(void)
 			uint64_t dest_offset = (uint64_t)cmd->dest_block * 512;
 			uint64_t data_size = (uint64_t)512;
 			if (!DataSizeCheck(dest_offset, data_size)) {
-				std::cerr << "DataSizeCheck failed!" << std::endl;
+				SDHR_LOG_ERROR("DataSizeCheck failed!");
 				return false;
 			}
-			/*
-			std::cout << std::hex << "Uploaded from: " << (uint64_t)(cmd->source_addr) 
-				<< " To: " << (uint64_t)(uploaded_data_region + dest_offset)
-				<< " Amount: " << std::dec << (uint64_t)data_size
-				<< " Destination Block: " << (uint64_t)cmd->dest_block
-				<< std::endl;
-			*/
+			SDHR_LOG_TRACE("SDHR_CMD_UPLOAD_DATA: Uploaded from: %x To offset: %llx Amount: %llu Destination Block: %u",
+				(uint32_t)cmd->source_addr, (unsigned long long)dest_offset,
+				(unsigned long long)data_size, (uint32_t)cmd->dest_block);
 			memcpy(uploaded_data_region + dest_offset, a2mem + ((uint16_t)cmd->source_addr), data_size);
 			// std::cout << "SDHR_CMD_UPLOAD_DATA: Success: " << std::hex << data_size << std::endl;
 		} break;
@@ -403,25 +724,25 @@ bool SDHRManager::ProcessCommands(void)
 			DefineImageAssetCmd* cmd = (DefineImageAssetCmd*)p;
 			uint64_t upload_start_addr = 0;
 			uint64_t upload_data_size = (uint64_t)cmd->block_count * 512;
-
-			ImageAsset* r = image_assets + cmd->asset_index;
-
-			if (r->data != NULL) {
-				stbi_image_free(r->data);
-			}
-			r->AssignByMemory(this, uploaded_data_region + upload_start_addr, upload_data_size);
-			if (error_flag) {
-				std::cerr << "AssignByMemory failed!" << std::endl;
+			if (!DataSizeCheck(upload_start_addr, upload_data_size)) {
+				SDHR_LOG_ERROR("DataSizeCheck failed!");
 				return false;
 			}
-			std::cout << "SDHR_CMD_DEFINE_IMAGE_ASSET: Success:" << r->image_xcount << " x " << r->image_ycount << std::endl;
+
+			// The decode runs on a worker, with its own copy since the region
+			// can be overwritten by the next uploads. Commands that use the asset wait for it.
+			ImageAsset* r = image_assets + cmd->asset_index;
+			r->AssignByMemory(std::vector<uint8_t>(uploaded_data_region + upload_start_addr,
+				uploaded_data_region + upload_start_addr + upload_data_size));
+			SDHR_LOG_DEBUG("SDHR_CMD_DEFINE_IMAGE_ASSET: Decoding %llu bytes into asset %u",
+				(unsigned long long)upload_data_size, (uint32_t)cmd->asset_index);
 		} break;
 		case SDHR_CMD_DEFINE_IMAGE_ASSET_FILENAME: {
-			std::cout << "SDHR_CMD_DEFINE_IMAGE_ASSET_FILENAME: Not Implemented." << std::endl;
+			SDHR_LOG_WARN("SDHR_CMD_DEFINE_IMAGE_ASSET_FILENAME: Not Implemented.");
 			// NOT IMPLEMENTED
 		} break;
 		case SDHR_CMD_UPLOAD_DATA_FILENAME: {
-			std::cout << "SDHR_CMD_UPLOAD_DATA_FILENAME: Not Implemented." << std::endl;
+			SDHR_LOG_WARN("SDHR_CMD_UPLOAD_DATA_FILENAME: Not Implemented.");
 			// NOT IMPLEMENTED
 		} break;
 		case SDHR_CMD_DEFINE_TILESET: {
@@ -436,8 +757,9 @@ bool SDHRManager::ProcessCommands(void)
 				CommandError("Insufficient data space for tileset");
 			}
 			ImageAsset* asset = image_assets + cmd->asset_index;
-			DefineTileset(cmd->tileset_index, num_entries, cmd->xdim, cmd->ydim, asset, uploaded_data_region);
-			std::cout << "SDHR_CMD_DEFINE_TILESET: Success! " << (uint32_t)cmd->tileset_index << ';'<< (uint32_t)num_entries << std::endl;
+			if (!DefineTileset(cmd->tileset_index, num_entries, cmd->xdim, cmd->ydim, asset, uploaded_data_region))
+				return false;
+			SDHR_LOG_DEBUG("SDHR_CMD_DEFINE_TILESET: Success! %u;%u", (uint32_t)cmd->tileset_index, (uint32_t)num_entries);
 		} break;
 		case SDHR_CMD_DEFINE_TILESET_IMMEDIATE: {
 			if (!CheckCommandLength(p, end, sizeof(DefineTilesetImmediateCmd))) return false;
@@ -453,8 +775,9 @@ bool SDHRManager::ProcessCommands(void)
 				return false;
 			}
 			ImageAsset* asset = image_assets + cmd->asset_index;
-			DefineTileset(cmd->tileset_index, num_entries, cmd->xdim, cmd->ydim, asset, cmd->data);
-			std::cout << "SDHR_CMD_DEFINE_TILESET_IMMEDIATE: Success! " << (uint32_t)cmd->tileset_index << ';' << (uint32_t)num_entries << std::endl;
+			if (!DefineTileset(cmd->tileset_index, num_entries, cmd->xdim, cmd->ydim, asset, cmd->data))
+				return false;
+			SDHR_LOG_DEBUG("SDHR_CMD_DEFINE_TILESET_IMMEDIATE: Success! %u;%u", (uint32_t)cmd->tileset_index, (uint32_t)num_entries);
 		} break;
 		case SDHR_CMD_DEFINE_WINDOW: {
 			if (!CheckCommandLength(p, end, sizeof(DefineWindowCmd))) return false;
@@ -468,7 +791,11 @@ bool SDHRManager::ProcessCommands(void)
 				CommandError("Window exceeds max y resolution");
 				return false;
 			}
-			r->enabled = false;
+			if ((uint64_t)cmd->tile_xcount * cmd->tile_ycount == 0) {
+				CommandError("Window has no tiles");
+				return false;
+			}
+			SetWindowEnabled(cmd->window_index, false);
 			r->screen_xcount = cmd->screen_xcount;
 			r->screen_ycount = cmd->screen_ycount;
 			r->screen_xbegin = 0;
@@ -482,13 +809,17 @@ bool SDHRManager::ProcessCommands(void)
 			if (r->tilesets) {
 				free(r->tilesets);
 			}
-			r->tilesets = (uint8_t*)malloc(r->tile_xcount * r->tile_ycount);
+			// tileset 0, index 0 until the tiles are set
+			r->tilesets = (uint8_t*)calloc(r->tile_xcount * r->tile_ycount, 1);
 			if (r->tile_indexes) {
 				free(r->tile_indexes);
 			}
-			r->tile_indexes = (uint8_t*)malloc(r->tile_xcount * r->tile_ycount);
-			std::cout << "SDHR_CMD_DEFINE_WINDOW: Success! " 
-				<< cmd->window_index << ';' << (uint32_t)r->tile_xcount << ';' << (uint32_t)r->tile_ycount << std::endl;
+			r->tile_indexes = (uint8_t*)calloc(r->tile_xcount * r->tile_ycount, 1);
+			free(r->palette);
+			r->palette = NULL;
+			InvalidateRenderPlan(cmd->window_index, RENDER_PLAN_GEOMETRY | RENDER_PLAN_TILES);
+			SDHR_LOG_DEBUG("SDHR_CMD_DEFINE_WINDOW: Success! %u;%u;%u",
+				(uint32_t)cmd->window_index, (uint32_t)r->tile_xcount, (uint32_t)r->tile_ycount);
 		} break;
 		case SDHR_CMD_UPDATE_WINDOW_SET_IMMEDIATE: {
 			size_t cmd_sz = sizeof(UpdateWindowSetImmediateCmd);
@@ -502,22 +833,17 @@ bool SDHRManager::ProcessCommands(void)
 				CommandError("UpdateWindowSetImmediate data size mismatch");
 				return false;
 			}
+			if (message_length != 3 + cmd_sz + cmd->data_length) {
+				CommandError("UpdateWindowSetImmediate message length mismatch");
+				return false;
+			}
 			if (!CheckCommandLength(p, end, cmd_sz + cmd->data_length)) return false;
-			uint8_t* sp = p + cmd_sz;
-			for (uint64_t i = 0; i < cmd->data_length / 2; ++i) {
-				uint8_t tileset_index = sp[i * 2];
-				uint8_t tile_index = sp[i * 2 + 1];
-				if (tileset_records[tileset_index].xdim != r->tile_xdim ||
-					tileset_records[tileset_index].ydim != r->tile_ydim ||
-					tileset_records[tileset_index].num_entries <= tile_index) {
-					CommandError("invalid tile specification");
-					return false;
-				}
-				r->tilesets[i] = tileset_index;
-				r->tile_indexes[i] = tile_index;
+			if (!SetWindowTiles(r, p + cmd_sz, cmd->data_length / 2)) {
+				CommandError("invalid tile specification");
+				return false;
 			}
-			p += cmd->data_length;
-			std::cout << "SDHR_CMD_UPDATE_WINDOW_SET_IMMEDIATE: Success!" << std::endl;
+			InvalidateRenderPlan(cmd->window_index, RENDER_PLAN_TILES);
+			SDHR_LOG_DEBUG("SDHR_CMD_UPDATE_WINDOW_SET_IMMEDIATE: Success!");
 		} break;
 		case SDHR_CMD_UPDATE_WINDOW_SET_UPLOAD: {
 			if (!CheckCommandLength(p, end, sizeof(UpdateWindowSetUploadCmd))) return false;
@@ -525,29 +851,26 @@ bool SDHRManager::ProcessCommands(void)
 			Window* r = windows + cmd->window_index;
 			// full tile specification: tileset and index
 			uint64_t data_size = (uint64_t)cmd->block_count * 512;
-			std::stringstream ss;
-			upload_inflate((const char*)uploaded_data_region, data_size, ss);
-			std::string s = ss.str();
-			if (s.length() != r->tile_xcount * r->tile_ycount * 2) {
-				CommandError("UploadWindowSetUpload data insufficient to define window tiles");
-			}
-			uint8_t* sp = (uint8_t*)s.c_str();
-			for (uint64_t tile_y = 0; tile_y < r->tile_ycount; ++tile_y) {
-				uint64_t line_offset = (uint64_t)tile_y * r->tile_xcount;
-				for (uint64_t tile_x = 0; tile_x < r->tile_xcount; ++tile_x) {
-					uint8_t tileset_index = *sp++;
-					uint8_t tile_index = *sp++;
-					if (tileset_records[tileset_index].xdim != r->tile_xdim ||
-						tileset_records[tileset_index].ydim != r->tile_ydim ||
-						tileset_records[tileset_index].num_entries <= tile_index) {
-						CommandError("invalid tile specification");
-						return false;
-					}
-					r->tilesets[line_offset + tile_x] = tileset_index;
-					r->tile_indexes[line_offset + tile_x] = tile_index;
-				}
+			if (!DataSizeCheck(0, data_size)) {
+				SDHR_LOG_ERROR("DataSizeCheck failed!");
+				return false;
+			}
+			uint64_t tile_count = r->tile_xcount * r->tile_ycount;
+			if (upload_scratch.size() < tile_count * 2)
+				upload_scratch.resize(tile_count * 2);
+			uint64_t inflated_size = 0;
+			// a longer map doesn't fit and fails like corrupt data
+			int ret = inflater.Inflate(uploaded_data_region, data_size, upload_scratch.data(), tile_count * 2, &inflated_size);
+			if (ret != Z_OK || inflated_size != tile_count * 2) {
+				CommandError("UploadWindowSetUpload data doesn't define the window tiles");
+				return false;
+			}
+			if (!SetWindowTiles(r, upload_scratch.data(), tile_count)) {
+				CommandError("invalid tile specification");
+				return false;
 			}
-			std::cout << "SDHR_CMD_UPDATE_WINDOW_SET_UPLOAD: Success!" << std::endl;
+			InvalidateRenderPlan(cmd->window_index, RENDER_PLAN_TILES);
+			SDHR_LOG_DEBUG("SDHR_CMD_UPDATE_WINDOW_SET_UPLOAD: Success!");
 		} break;
 /*
 		case SDHR_CMD_UPDATE_WINDOW_SINGLE_TILESET: {
@@ -580,7 +903,7 @@ bool SDHRManager::ProcessCommands(void)
 					r->tile_indexes[line_offset + tile_x] = tile_index;
 				}
 			}
-			std::cout << "SDHR_CMD_UPDATE_WINDOW_SINGLE_TILESET: Success!" << std::endl;
+			SDHR_LOG_DEBUG("SDHR_CMD_UPDATE_WINDOW_SINGLE_TILESET: Success!");
 		} break;
 */
 		case SDHR_CMD_UPDATE_WINDOW_SHIFT_TILES: {
@@ -595,46 +918,35 @@ bool SDHRManager::ProcessCommands(void)
 				CommandError("invalid window for tile shift");
 				return false;
 			}
-			if (cmd->x_dir == -1) {
-				for (uint64_t y_index = 0; y_index < r->tile_ycount; ++y_index) {
-					uint64_t line_offset = y_index * r->tile_xcount;
-					for (uint64_t x_index = 1; x_index < r->tile_xcount; ++x_index) {
-						r->tilesets[line_offset + x_index - 1] = r->tilesets[line_offset + x_index];
-						r->tile_indexes[line_offset + x_index - 1] = r->tile_indexes[line_offset + x_index];
-					}
-				}
-			}
-			else if (cmd->x_dir == 1) {
-				for (uint64_t y_index = 0; y_index < r->tile_ycount; ++y_index) {
-					uint64_t line_offset = y_index * r->tile_xcount;
-					for (uint64_t x_index = r->tile_xcount - 1; x_index > 0; --x_index) {
-						r->tilesets[line_offset + x_index] = r->tilesets[line_offset + x_index - 1];
-						r->tile_indexes[line_offset + x_index] = r->tile_indexes[line_offset + x_index - 1];
-					}
-				}
-			}
-			if (cmd->y_dir == -1) {
-				for (uint64_t y_index = 1; y_index < r->tile_ycount; ++y_index) {
-					uint64_t line_offset = y_index * r->tile_xcount;
-					uint64_t prev_line_offset = line_offset - r->tile_xcount;
-					for (uint64_t x_index = 0; x_index < r->tile_xcount; ++x_index) {
-						r->tilesets[prev_line_offset + x_index] = r->tilesets[line_offset + x_index];
-						r->tile_indexes[prev_line_offset + x_index] = r->tile_indexes[line_offset + x_index];
-					}
-				}
+			ShiftTilePlane(r->tilesets, r->tile_xcount, r->tile_ycount, cmd->x_dir, cmd->y_dir, NULL);
+			ShiftTilePlane(r->tile_indexes, r->tile_xcount, r->tile_ycount, cmd->x_dir, cmd->y_dir, NULL);
+			InvalidateRenderPlan(cmd->window_index, RENDER_PLAN_TILES);
+			SDHR_LOG_DEBUG("SDHR_CMD_UPDATE_WINDOW_SHIFT_TILES: Success! %u;%d;%d",
+				(uint32_t)cmd->window_index, (int32_t)cmd->x_dir, (int32_t)cmd->y_dir);
+		} break;
+		case SDHR_CMD_UPDATE_WINDOW_SHIFT_TILES_BY: {
+			if (!CheckCommandLength(p, end, sizeof(UpdateWindowShiftTilesByCmd))) return false;
+			UpdateWindowShiftTilesByCmd* cmd = (UpdateWindowShiftTilesByCmd*)p;
+			Window* r = windows + cmd->window_index;
+			if (r->tile_xcount == 0 || r->tile_ycount == 0) {
+				CommandError("invalid window for tile shift");
+				return false;
 			}
-			else if (cmd->y_dir == 1) {
-				for (uint64_t y_index = r->tile_ycount - 1; y_index > 0; --y_index) {
-					uint64_t line_offset = y_index * r->tile_xcount;
-					uint64_t prev_line_offset = line_offset - r->tile_xcount;
-					for (uint64_t x_index = 0; x_index < r->tile_xcount; ++x_index) {
-						r->tilesets[line_offset + x_index] = r->tilesets[prev_line_offset + x_index];
-						r->tile_indexes[line_offset + x_index] = r->tile_indexes[prev_line_offset + x_index];
-					}
+			if (cmd->fill) {
+				uint16_t limits[256];
+				WindowTileLimits(r, limits);
+				if (!ValidTileEntries(limits, &cmd->fill_tileset, 1)) {
+					CommandError("invalid tile specification");
+					return false;
 				}
 			}
-			std::cout << "SDHR_CMD_UPDATE_WINDOW_SHIFT_TILES: Success! " 
-				<< (uint32_t)cmd->window_index << ';' << (uint32_t)cmd->x_dir << ';' << (uint32_t)cmd->y_dir << std::endl;
+			ShiftTilePlane(r->tilesets, r->tile_xcount, r->tile_ycount, cmd->x_shift, cmd->y_shift,
+				cmd->fill ? &cmd->fill_tileset : NULL);
+			ShiftTilePlane(r->tile_indexes, r->tile_xcount, r->tile_ycount, cmd->x_shift, cmd->y_shift,
+				cmd->fill ? &cmd->fill_index : NULL);
+			InvalidateRenderPlan(cmd->window_index, RENDER_PLAN_TILES);
+			SDHR_LOG_DEBUG("SDHR_CMD_UPDATE_WINDOW_SHIFT_TILES_BY: Success! %u;%d;%d;%u",
+				(uint32_t)cmd->window_index, (int32_t)cmd->x_shift, (int32_t)cmd->y_shift, (uint32_t)cmd->fill);
 		} break;
 		case SDHR_CMD_UPDATE_WINDOW_SET_WINDOW_POSITION: {
 			if (!CheckCommandLength(p, end, sizeof(UpdateWindowSetWindowPositionCmd))) return false;
@@ -642,8 +954,9 @@ bool SDHRManager::ProcessCommands(void)
 			Window* r = windows + cmd->window_index;
 			r->screen_xbegin = cmd->screen_xbegin;
 			r->screen_ybegin = cmd->screen_ybegin;
-			std::cout << "SDHR_CMD_UPDATE_WINDOW_SET_WINDOW_POSITION: Success! "
-				<< (uint32_t)cmd->window_index << ';' << (uint32_t)cmd->screen_xbegin << ';' << (uint32_t)cmd->screen_ybegin << std::endl;
+			InvalidateRenderPlan(cmd->window_index, RENDER_PLAN_GEOMETRY);
+			SDHR_LOG_DEBUG("SDHR_CMD_UPDATE_WINDOW_SET_WINDOW_POSITION: Success! %u;%d;%d",
+				(uint32_t)cmd->window_index, (int32_t)cmd->screen_xbegin, (int32_t)cmd->screen_ybegin);
 		} break;
 		case SDHR_CMD_UPDATE_WINDOW_ADJUST_WINDOW_VIEW: {
 			if (!CheckCommandLength(p, end, sizeof(UpdateWindowAdjustWindowViewCommand))) return false;
@@ -651,8 +964,9 @@ bool SDHRManager::ProcessCommands(void)
 			Window* r = windows + cmd->window_index;
 			r->tile_xbegin = cmd->tile_xbegin;
 			r->tile_ybegin = cmd->tile_ybegin;
-			std::cout << "SDHR_CMD_UPDATE_WINDOW_ADJUST_WINDOW_VIEW: Success! "
-				<< (uint32_t)cmd->window_index << ';' << (uint32_t)cmd->tile_xbegin << ';' << (uint32_t)cmd->tile_ybegin << std::endl;
+			InvalidateRenderPlan(cmd->window_index, RENDER_PLAN_GEOMETRY | RENDER_PLAN_LAYER);
+			SDHR_LOG_DEBUG("SDHR_CMD_UPDATE_WINDOW_ADJUST_WINDOW_VIEW: Success! %u;%d;%d",
+				(uint32_t)cmd->window_index, (int32_t)cmd->tile_xbegin, (int32_t)cmd->tile_ybegin);
 		} break;
 		case SDHR_CMD_UPDATE_WINDOW_ENABLE: {
 			if (!CheckCommandLength(p, end, sizeof(UpdateWindowEnableCmd))) return false;
@@ -662,9 +976,176 @@ bool SDHRManager::ProcessCommands(void)
 				CommandError("cannote enable empty window");
 				return false;
 			}
-			r->enabled = cmd->enabled;
-			std::cout << "SDHR_CMD_UPDATE_WINDOW_ENABLE: Success! "
-				<< (uint32_t)cmd->window_index << std::endl;
+			SetWindowEnabled(cmd->window_index, cmd->enabled);
+			SDHR_LOG_DEBUG("SDHR_CMD_UPDATE_WINDOW_ENABLE: Success! %u", (uint32_t)cmd->window_index);
+		} break;
+		case SDHR_CMD_UPDATE_WINDOW_SET_PALETTE: {
+			size_t cmd_sz = sizeof(UpdateWindowSetPaletteCmd);
+			if (!CheckCommandLength(p, end, cmd_sz)) return false;
+			UpdateWindowSetPaletteCmd* cmd = (UpdateWindowSetPaletteCmd*)p;
+			Window* r = windows + cmd->window_index;
+			if (message_length != 3 + cmd_sz + (size_t)cmd->count * 4) {
+				CommandError("UpdateWindowSetPalette data size mismatch");
+				return false;
+			}
+			if (cmd->count == 0) {
+				free(r->palette);
+				r->palette = NULL;
+				InvalidateRenderPlan(cmd->window_index, RENDER_PLAN_TILES);
+				SDHR_LOG_DEBUG("SDHR_CMD_UPDATE_WINDOW_SET_PALETTE: Success! %u reset", (uint32_t)cmd->window_index);
+				break;
+			}
+			if ((uint32_t)cmd->first_index + cmd->count > 256) {
+				CommandError("palette entries out of range");
+				return false;
+			}
+			if (!r->tilesets) {
+				CommandError("cannot set the palette of an undefined window");
+				return false;
+			}
+			if (tileset_records[cmd->tileset_index].num_entries == 0) {
+				CommandError("cannot set the palette of an undefined tileset");
+				return false;
+			}
+			if (r->palette == NULL || r->palette_tileset != cmd->tileset_index) {
+				if (r->palette == NULL)
+					r->palette = (uint32_t*)malloc(256 * sizeof(uint32_t));
+				r->palette_tileset = cmd->tileset_index;
+				memcpy(r->palette, tileset_records[r->palette_tileset].palette, 256 * sizeof(uint32_t));
+				InvalidateRenderPlan(cmd->window_index, RENDER_PLAN_TILES);
+			}
+			bgra_t* colours = (bgra_t*)cmd->data;
+			for (uint16_t i = 0; i < cmd->count; ++i) {
+				r->palette[cmd->first_index + i] = ((uint32_t)colours[i].a << 24) | ((uint32_t)colours[i].r << 16)
+					| ((uint32_t)colours[i].g << 8) | colours[i].b;
+			}
+			InvalidateRenderPlan(cmd->window_index, RENDER_PLAN_LAYER);
+			SDHR_LOG_DEBUG("SDHR_CMD_UPDATE_WINDOW_SET_PALETTE: Success! %u;%u;%u", (uint32_t)cmd->window_index,
+				(uint32_t)cmd->first_index, (uint32_t)cmd->count);
+		} break;
+		case SDHR_CMD_UPDATE_WINDOW_SET_RUNS: {
+			size_t cmd_sz = sizeof(UpdateWindowSetRunsCmd);
+			if (!CheckCommandLength(p, end, cmd_sz)) return false;
+			UpdateWindowSetRunsCmd* cmd = (UpdateWindowSetRunsCmd*)p;
+			Window* r = windows + cmd->window_index;
+			uint8_t* message_end = p + message_length - 3;
+			if (message_end > end || message_length < 3 + cmd_sz) {
+				CommandError("UpdateWindowSetRuns data size mismatch");
+				return false;
+			}
+			uint64_t tile_count = r->tilesets ? r->tile_xcount * r->tile_ycount : 0;
+			uint16_t limits[256];
+			WindowTileLimits(r, limits);
+			// all runs are checked before any is applied
+			uint8_t* rp = cmd->data;
+			for (uint16_t i = 0; i < cmd->run_count; ++i) {
+				if (message_end - rp < 5) {
+					CommandError("UpdateWindowSetRuns data size mismatch");
+					return false;
+				}
+				uint64_t first = *((uint32_t*)rp);
+				uint64_t length = rp[4] ? rp[4] : 256;
+				if ((uint64_t)(message_end - rp - 5) < length * 2) {
+					CommandError("UpdateWindowSetRuns data size mismatch");
+					return false;
+				}
+				if (first + length > tile_count) {
+					CommandError("tile run exceeds window tiles");
+					return false;
+				}
+				if (!ValidTileEntries(limits, rp + 5, length)) {
+					CommandError("invalid tile specification");
+					return false;
+				}
+				rp += 5 + length * 2;
+			}
+			rp = cmd->data;
+			for (uint16_t i = 0; i < cmd->run_count; ++i) {
+				uint64_t length = rp[4] ? rp[4] : 256;
+				ScatterTiles(r, *((uint32_t*)rp), rp + 5, length);
+				rp += 5 + length * 2;
+			}
+			InvalidateRenderPlan(cmd->window_index, RENDER_PLAN_TILES);
+			SDHR_LOG_DEBUG("SDHR_CMD_UPDATE_WINDOW_SET_RUNS: Success! %u;%u", (uint32_t)cmd->window_index,
+				(uint32_t)cmd->run_count);
+		} break;
+		case SDHR_CMD_UPDATE_WINDOW_SET_REGION: {
+			size_t cmd_sz = sizeof(UpdateWindowSetRegionCmd);
+			if (!CheckCommandLength(p, end, cmd_sz)) return false;
+			UpdateWindowSetRegionCmd* cmd = (UpdateWindowSetRegionCmd*)p;
+			Window* r = windows + cmd->window_index;
+			if (!r->tilesets ||
+				(uint64_t)cmd->tile_xbegin + cmd->tile_xcount > r->tile_xcount ||
+				(uint64_t)cmd->tile_ybegin + cmd->tile_ycount > r->tile_ycount) {
+				CommandError("tile update region exceeds tile dimensions");
+				return false;
+			}
+			uint64_t data_size = (uint64_t)cmd->tile_xcount * cmd->tile_ycount * 2;
+			if (data_size + cmd_sz + 3 != message_length) {
+				CommandError("UpdateWindowSetRegion data size mismatch");
+				return false;
+			}
+			if (!CheckCommandLength(p, end, cmd_sz + data_size)) return false;
+			uint16_t limits[256];
+			WindowTileLimits(r, limits);
+			if (!ValidTileEntries(limits, cmd->data, data_size / 2)) {
+				CommandError("invalid tile specification");
+				return false;
+			}
+			for (uint64_t tile_y = 0; tile_y < cmd->tile_ycount; ++tile_y) {
+				uint64_t first = (cmd->tile_ybegin + tile_y) * r->tile_xcount + cmd->tile_xbegin;
+				ScatterTiles(r, first, cmd->data + tile_y * cmd->tile_xcount * 2, cmd->tile_xcount);
+			}
+			InvalidateRenderPlan(cmd->window_index, RENDER_PLAN_TILES);
+			SDHR_LOG_DEBUG("SDHR_CMD_UPDATE_WINDOW_SET_REGION: Success! %u;%u;%u;%u;%u", (uint32_t)cmd->window_index,
+				(uint32_t)cmd->tile_xbegin, (uint32_t)cmd->tile_ybegin, (uint32_t)cmd->tile_xcount, (uint32_t)cmd->tile_ycount);
+		} break;
+		case SDHR_CMD_COMPRESSED: {
+			size_t cmd_sz = sizeof(CompressedCmd);
+			if (!CheckCommandLength(p, end, cmd_sz)) return false;
+			CompressedCmd* cmd = (CompressedCmd*)p;
+			if (message_length < 3 + cmd_sz) {
+				CommandError("compressed command too short");
+				return false;
+			}
+			if (in_compressed) {
+				CommandError("compressed commands cannot be nested");
+				return false;
+			}
+			uint64_t compressed_size = message_length - 3 - cmd_sz;
+			uint64_t expected_size = cmd->uncompressed_length;
+			if (decompress_scratch.size() < expected_size)
+				decompress_scratch.resize(expected_size);
+			uint8_t* inner = decompress_scratch.data();
+			uint64_t inner_size = 0;
+			switch (cmd->codec) {
+			case SDHR_CODEC_ZLIB:
+				// Z_BUF_ERROR fills the buffer, but the commands were cut short
+				if (inflater.Inflate(cmd->data, compressed_size, inner, expected_size, &inner_size) != Z_OK)
+					inner_size = 0;
+				break;
+#if SDHR_USE_LZ4
+			case SDHR_CODEC_LZ4: {
+				int n = LZ4_decompress_safe((const char*)cmd->data, (char*)inner, (int)compressed_size, (int)expected_size);
+				inner_size = n < 0 ? 0 : n;
+			} break;
+#endif
+			default:
+				CommandError("unsupported compression codec");
+				return false;
+			}
+			if (inner_size != expected_size || expected_size < 3) {
+				CommandError("compressed commands don't decompress to their size");
+				return false;
+			}
+			Metrics::CountCompressed(inner[2], compressed_size, expected_size);
+			SDHR_LOG_DEBUG("SDHR_CMD_COMPRESSED: %s, %llu -> %llu bytes", CommandName(inner[2]),
+				(unsigned long long)compressed_size, (unsigned long long)expected_size);
+			in_compressed = true;
+			bool ok = ExecuteCommands(inner, inner + expected_size);
+			in_compressed = false;
+			if (!ok)
+				return false;
 		} break;
 		default:
 			CommandError("unrecognized command");
@@ -672,8 +1153,6 @@ bool SDHRManager::ProcessCommands(void)
 		}
 		p += message_length - 3;
 	}
-	// we're ready to draw
-	command_buffer.clear();
 	return true;
 }
 
@@ -684,70 +1163,78 @@ void SDHRManager::DrawWindowsIntoBuffer(modeset_buf* framebuffer)
 	using std::chrono::duration;
 	using std::chrono::milliseconds;
 
-	duration<double, std::milli> ms_double2;
 	auto t1 = high_resolution_clock::now();
-
-	// std::cout << "Entered DrawWindowsIntoBuffer" << std::endl;
-	// Set the scaling factor to fullscreen the video
-	auto _scalew = framebuffer->width / screen_xcount;
-	auto _scaleh = framebuffer->height / screen_ycount;
-	auto _scale = (_scaleh < _scalew ? _scaleh : _scalew);
-	_scale = 1;
+	SDHR_TRACE_SCOPE("DrawWindowsIntoBuffer");
 
 	auto fbmap = reinterpret_cast<uint32_t *>(framebuffer->map);
+	uint64_t fb_pitch = framebuffer->stride / 4;
 
 	// Draw the windows into the passed-in framebuffer;
-	uint32_t pixel_color_argb888 = 0;
-	for (uint16_t window_index = 0; window_index < 256; ++window_index) {
-		Window* w = windows + window_index;
-		if (!w->enabled) {
+	// plans only change with their window or tilesets, so this is mostly copying
+	for (uint8_t window_index : enabled_windows) {
+		RenderPlan* plan = render_plans + window_index;
+		if (plan->stale & RENDER_PLAN_LAYER)
+			DropLayer(plan);
+		if (plan->stale & RENDER_PLAN_GEOMETRY)
+			BuildPlanGeometry(window_index);
+		if (plan->stale & RENDER_PLAN_TILES)
+			BuildPlanTiles(window_index);
+		plan->stale = 0;
+		if (!plan->visible)
+			continue;
+		SDHR_TRACE_SCOPE("draw_window", "window", window_index);
+		const WindowDraw* d = &plan->draw;
+		if (!plan->has_layer && layer_cache_budget && ++plan->steady_frames >= LAYER_STEADY_FRAMES)
+			BuildLayer(window_index);
+		if (plan->has_layer) {
+			// only the opaque runs, clipped to the screen
+			const Window* w = windows + window_index;
+			int32_t clip_xend = d->layer_xoffset + (d->clip_xend - d->clip_xbegin);
+			for (int32_t row = 0; row < d->clip_yend - d->clip_ybegin; ++row) {
+				uint64_t layer_y = d->layer_yoffset + row;
+				const uint32_t* src_row = plan->layer.data() + layer_y * w->screen_xcount;
+				uint32_t* dest_row = fbmap + (uint64_t)(d->clip_ybegin + row) * fb_pitch + d->clip_xbegin - d->layer_xoffset;
+				for (uint32_t r = plan->layer_rows[layer_y]; r < plan->layer_rows[layer_y + 1]; ++r) {
+					int32_t xbegin = std::max((int32_t)plan->layer_runs[r].x, d->layer_xoffset);
+					int32_t xend = std::min((int32_t)(plan->layer_runs[r].x + plan->layer_runs[r].count), clip_xend);
+					if (xbegin < xend)
+						memcpy(dest_row + xbegin, src_row + xbegin, (xend - xbegin) * sizeof(uint32_t));
+				}
+			}
+			SDHR_LOG_TRACE("Drew into buffer window %u from its layer", (uint32_t)window_index);
 			continue;
 		}
-		for (int64_t tile_y = w->tile_ybegin; tile_y < w->tile_ybegin + (int64_t)w->screen_ycount; ++tile_y) {
-			int64_t adj_tile_y = tile_y;
-			int64_t tile_yspan = (int64_t)w->tile_ycount * w->tile_ydim;
-			while (adj_tile_y < 0) adj_tile_y += tile_yspan;
-			while (adj_tile_y >= tile_yspan) adj_tile_y -= tile_yspan;
-			uint64_t tile_yindex = adj_tile_y / w->tile_ydim;
-			uint64_t tile_yoffset = adj_tile_y % w->tile_ydim;
-			for (int64_t tile_x = w->tile_xbegin; tile_x < w->tile_xbegin + (int64_t)w->screen_xcount; ++tile_x) {
-				// check if destination pixel is offscreen
-				int64_t screen_y = tile_y + w->screen_ybegin - w->tile_ybegin;
-				int64_t screen_x = tile_x + w->screen_xbegin - w->tile_xbegin;
-				if (screen_x < 0 || screen_y < 0 || screen_x > screen_xcount || screen_y > screen_ycount) {
-					// destination pixel is offscreen, do not draw
+		const TileRef* tiles = plan->tiles.data();
+		for (int32_t row = 0; row < d->clip_yend - d->clip_ybegin; ++row) {
+			uint32_t* dest_row = fbmap + (uint64_t)(d->clip_ybegin + row) * fb_pitch;
+			const TileRef* row_tiles = tiles + plan->row_entries[row];
+			uint32_t row_pixel = plan->row_pixels[row];
+			for (const ColumnRun& run : plan->column_runs) {
+				const TileRef& ref = row_tiles[run.tile_xindex];
+				if (ref.pixels == NULL)
 					continue;
+				uint32_t* dest = dest_row + run.screen_x;
+				uint32_t first = row_pixel + run.tile_xoffset;
+				if (ref.palette) {
+					const uint8_t* src = ref.pixels + first;
+					for (uint16_t i = 0; i < run.count; ++i) {
+						uint32_t pixel_color_argb888 = ref.palette[src[i]];
+						if (pixel_color_argb888 & 0xFF000000)	// zero alpha, don't draw
+							dest[i] = pixel_color_argb888;
+					}
 				}
-				int64_t adj_tile_x = tile_x;
-				int64_t tile_xspan = (int64_t)w->tile_xcount * w->tile_xdim;
-				while (adj_tile_x < 0) adj_tile_x += tile_xspan;
-				while (adj_tile_x >= tile_xspan) adj_tile_x -= tile_xspan;
-				uint64_t tile_xindex = adj_tile_x / w->tile_xdim;
-				uint64_t tile_xoffset = adj_tile_x % w->tile_xdim;
-				uint64_t entry_index = tile_yindex * w->tile_xcount + tile_xindex;
-				TilesetRecord* t = tileset_records + w->tilesets[entry_index];
-				uint64_t tile_index = w->tile_indexes[entry_index];
-				pixel_color_argb888 = t->tile_data[tile_index * t->xdim * t->ydim + tile_yoffset * t->xdim + tile_xoffset];
-				if ((pixel_color_argb888 & 0xFF000000) == 0) {
-					continue; // zero alpha, don'd draw
-				}
-
-				// Where's the pixel?
-				int64_t screen_offset = ((framebuffer->stride * screen_y / 4) + (screen_x));
-				// Scale the video by the integer _scale
-				for (size_t i = 0; i < _scale; i++)
-				{
-					for (size_t j = 0; j < _scale; j++)
-					{
-						fbmap[(screen_offset * _scale) + (i) + (j * framebuffer->stride / 4)] = pixel_color_argb888;
+				else {
+					const uint32_t* src = (const uint32_t*)ref.pixels + first;
+					for (uint16_t i = 0; i < run.count; ++i) {
+						if (src[i] & 0xFF000000)
+							dest[i] = src[i];
 					}
 				}
 			}
 		}
-		std::cout << "Drew into buffer window " << window_index << std::endl;
+		SDHR_LOG_TRACE("Drew into buffer window %u", (uint32_t)window_index);
 	}
 	auto t2 = high_resolution_clock::now();
 	duration<double, std::milli> ms_double = t2 - t1;
-	std::cout << "DrawWindowsIntoBuffer() duration: " << ms_double.count() << "ms\n";
-	std::cout << "Framebuffer write: " << ms_double2.count() << "ms\n";
+	SDHR_LOG_DEBUG("DrawWindowsIntoBuffer() duration: %fms", ms_double.count());
 }
@@ -5,8 +5,17 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <vector>
+#include <iosfwd>
+#include <future>
+#include <memory>
 #include "DrawVBlank.h"
+#include "AssetCache.h"
+#include "TileAtlas.h"
+#include "Inflater.h"
+#include "MappedRegion.h"
 
 enum SDHRCtrl_e
 {
@@ -33,8 +42,160 @@ enum SDHRCmd_e {
 	SDHR_CMD_READY = 14,
 	SDHR_CMD_UPLOAD_DATA_FILENAME = 15,			// NOT RELEVANT, NOT IMPLEMENTED
 	SDHR_CMD_UPDATE_WINDOW_SET_UPLOAD = 16,
+	SDHR_CMD_UPDATE_WINDOW_SET_PALETTE = 17,
+	SDHR_CMD_COMPRESSED = 18,
+	SDHR_CMD_UPDATE_WINDOW_SET_RUNS = 19,
+	SDHR_CMD_UPDATE_WINDOW_SET_REGION = 20,
+	SDHR_CMD_UPDATE_WINDOW_SHIFT_TILES_BY = 21,
 };
 
+enum SDHRCodec_e {
+	SDHR_CODEC_ZLIB = 0,	// zlib or gzip
+	SDHR_CODEC_LZ4 = 1,		// raw LZ4 block, when built with SDHR_USE_LZ4
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Commands structs
+//////////////////////////////////////////////////////////////////////////
+
+#pragma pack(push)
+#pragma pack(1)
+
+struct UploadDataCmd {
+	uint16_t dest_block;
+	uint16_t source_addr;
+};
+
+struct UploadDataFilenameCmd {
+	uint8_t dest_addr_med;
+	uint8_t dest_addr_high;
+	uint8_t filename_length;
+	uint8_t filename[];
+};
+
+struct DefineImageAssetCmd {
+	uint8_t asset_index;
+	uint16_t block_count;
+};
+
+struct DefineImageAssetFilenameCmd {
+	uint8_t asset_index;
+	uint8_t filename_length;
+	uint8_t filename[];  // don't include the trailing null either in the data or counted in the filename_length
+};
+
+struct DefineTilesetCmd {
+	uint8_t tileset_index;
+	uint8_t asset_index;
+	uint8_t num_entries;
+	uint16_t xdim;
+	uint16_t ydim;
+	uint16_t block_count;
+};
+
+struct DefineTilesetImmediateCmd {
+	uint8_t tileset_index;
+	uint8_t num_entries;
+	uint8_t xdim;
+	uint8_t ydim;
+	uint8_t asset_index;
+	uint8_t data[];  // data is 4-byte records, 16-bit x and y offsets (scaled by x/ydim), from the given asset
+};
+
+struct DefineWindowCmd {
+	uint8_t window_index;
+	uint16_t screen_xcount;		// width in pixels of visible screen area of window
+	uint16_t screen_ycount;
+	uint16_t tile_xdim;			// xy dimension, in pixels, of tiles in the window.
+	uint16_t tile_ydim;
+	uint16_t tile_xcount;		// xy dimension, in tiles, of the tile array
+	uint16_t tile_ycount;
+};
+
+struct UpdateWindowSetImmediateCmd {
+	uint8_t window_index;
+	uint16_t data_length;
+};
+
+struct UpdateWindowSetUploadCmd {
+	uint8_t window_index;
+	uint16_t block_count;
+};
+
+// Colours for the indexed tiles of tileset_index drawn in the window, from first_index on.
+// The first one gives the window its own palette, a copy of the palette of the
+// tileset. count 0 drops it and goes back to the tilesets' palettes.
+struct UpdateWindowSetPaletteCmd {
+	uint8_t window_index;
+	uint8_t tileset_index;
+	uint8_t first_index;
+	uint16_t count;
+	uint8_t data[];  // count 4-byte b, g, r, a records
+};
+
+// Holds one or more complete commands (length, id and data each), compressed.
+// They run as if they were in the command buffer, except for another COMPRESSED.
+struct CompressedCmd {
+	uint8_t codec;					// SDHRCodec_e
+	uint16_t uncompressed_length;	// of the commands inside
+	uint8_t data[];					// up to the end of the command
+};
+
+// Changes only some tiles: run_count runs of consecutive tiles, in row-major
+// order over the window's tile array. Each run is a uint32_t first tile,
+// a uint8_t length (0 means 256), then length (tileset, index) pairs.
+struct UpdateWindowSetRunsCmd {
+	uint8_t window_index;
+	uint16_t run_count;
+	uint8_t data[];
+};
+
+// Changes a rectangle of tiles, given as (tileset, index) pairs row by row
+struct UpdateWindowSetRegionCmd {
+	uint8_t window_index;
+	uint16_t tile_xbegin;
+	uint16_t tile_ybegin;
+	uint16_t tile_xcount;
+	uint16_t tile_ycount;
+	uint8_t data[];
+};
+
+struct UpdateWindowShiftTilesCmd {
+	uint8_t window_index;
+	int8_t x_dir; // +1 shifts tiles right by 1, negative shifts tiles left by 1, zero no change
+	int8_t y_dir; // +1 shifts tiles down by 1, negative shifts tiles up by 1, zero no change
+};
+
+// Shifts tiles by any number of tiles in one pass. Without fill, exposed
+// tiles repeat the edge as SHIFT_TILES does, otherwise they get the fill tile.
+struct UpdateWindowShiftTilesByCmd {
+	uint8_t window_index;
+	int16_t x_shift;	// positive shifts tiles right
+	int16_t y_shift;	// positive shifts tiles down
+	uint8_t fill;		// non zero to use fill_tileset, fill_index
+	uint8_t fill_tileset;	// followed by fill_index, checked as one pair
+	uint8_t fill_index;
+};
+
+struct UpdateWindowSetWindowPositionCmd {
+	uint8_t window_index;
+	int32_t screen_xbegin;
+	int32_t screen_ybegin;
+};
+
+struct UpdateWindowAdjustWindowViewCommand {
+	uint8_t window_index;
+	int32_t tile_xbegin;
+	int32_t tile_ybegin;
+};
+
+struct UpdateWindowEnableCmd {
+	uint8_t window_index;
+	uint8_t enabled;
+};
+
+#pragma pack(pop)
+
 struct bgra_t
 {
 	uint8_t b;
@@ -52,6 +213,7 @@ public:
 	void DrawWindowsIntoBuffer(modeset_buf* framebuffer);
 	uint32_t ARGB555_to_ARGB888(uint16_t argb555);
 	uint8_t* GetApple2MemPtr();	// Gets the Apple 2 memory pointer
+	static const char* CommandName(uint8_t cmd);
 
 	void ToggleSdhr(bool value) {
 		m_bEnabled = value;
@@ -77,27 +239,50 @@ private:
 // Singleton pattern
 //////////////////////////////////////////////////////////////////////////
 	void Initialize();
+	void FreeAllocations();
 
 	static SDHRManager* s_instance;
 	SDHRManager()
+		: a2mem(NULL), uploaded_data_region(NULL)
 	{
+		const char* dedup = getenv("SDHR_TILE_DEDUP");
+		tile_dedup = !(dedup && strcmp(dedup, "0") == 0);
+		const char* indexed = getenv("SDHR_INDEXED_TILES");
+		indexed_tiles = !(indexed && strcmp(indexed, "0") == 0);
+		const char* layer_mb = getenv("SDHR_LAYER_CACHE_MB");
+		if (layer_mb && *layer_mb)
+			layer_cache_budget = (uint64_t)atoll(layer_mb) << 20;
 		Initialize();
 	}
+	friend class SDHRBench;
 //////////////////////////////////////////////////////////////////////////
 // Internal state structs
 //////////////////////////////////////////////////////////////////////////
 
 	struct ImageAsset {
 		void AssignByFilename(const char* filename);	// currently unused
-		void AssignByMemory(SDHRManager* owner, const uint8_t* buffer, uint64_t size);
+		// Takes the PNG bytes and gets their pixels from the asset cache,
+		// or decodes them on the worker pool. The asset can only be used after Resolve().
+		void AssignByMemory(std::vector<uint8_t>&& buffer);
+		// Waits for a pending decode and takes its result, false if it failed
+		bool Resolve(SDHRManager* owner);
+		void Free();
 		void ExtractTile(SDHRManager* owner, uint32_t* tile_p,
 			uint16_t tile_xdim, uint16_t tile_ydim, 
 			uint64_t xsource, uint64_t ysource);
+		// Same, with the palette index of each pixel. Only when HasPalette().
+		void ExtractIndexedTile(SDHRManager* owner, uint8_t* tile_p,
+			uint16_t tile_xdim, uint16_t tile_ydim,
+			uint64_t xsource, uint64_t ysource);
+		bool HasPalette() const { return pixels && !pixels->palette.empty(); }
 
-		// image assets are full 32-bit bitmap files, uploaded from PNG
+		// image assets are full 32-bit bitmaps, uploaded from PNG and stored as ARGB like the tiles
 		uint64_t image_xcount = 0;
 		uint64_t image_ycount = 0;
-		uint8_t* data = NULL;
+		const uint8_t* data = NULL;
+		uint64_t key = 0;	// content hash of the PNG, known before the decode is done
+		std::shared_ptr<const ImagePixels> pixels;	// owns data, may be shared with the asset cache
+		std::shared_future<DecodedImage> pending;	// valid while a decode is in flight
 		ImageAsset()
 			: image_xcount(0)
 			, image_ycount(0)
@@ -105,17 +290,49 @@ private:
 		{}	// Do nothing in constructor
 	};
 
+	// Entries that point at identical pixels share one bitmap: tile_map gives
+	// the bitmap of each entry. Both live in one block, which is a tile atlas
+	// slot or a mapping of a disk cache file. Tiles cut from an asset with
+	// at most 256 colours are stored as 8-bit palette indexes instead of ARGB.
 	struct TilesetRecord {
 		uint64_t xdim;
 		uint64_t ydim;
 		uint64_t num_entries;
-		uint32_t* tile_data = NULL;  // tiledata is 32-bit RGBA
+		uint64_t num_bitmaps;		// distinct bitmaps in tile_data, at most num_entries
+		uint32_t* tile_data = NULL;  // tiledata is 32-bit ARGB, num_bitmaps tiles then tile_map
+		uint8_t* index_data = NULL;	// instead of tile_data for indexed tiles
+		uint16_t* tile_map = NULL;	// num_entries bitmap indexes
+		uint32_t palette[256];		// ARGB colours of the indexes
+		DiskCacheMapping tile_mapping;	// set when tile_data is mapped (read-only) from the disk cache
+		TileAtlasHandle atlas_slot;		// owned by SDHRManager::tile_atlas, kept across Free()
 		TilesetRecord()
 			: xdim(0)
 			, ydim(0)
 			, num_entries(0)
+			, num_bitmaps(0)
 			, tile_data()
+			, index_data()
+			, tile_map()
+			, palette()
 		{}
+		const uint32_t* Tile(uint64_t entry) const {
+			return tile_data + tile_map[entry] * xdim * ydim;
+		}
+		const uint8_t* IndexedTile(uint64_t entry) const {
+			return index_data + tile_map[entry] * xdim * ydim;
+		}
+		bool IsDefined() const { return tile_data || index_data; }
+		uint64_t BytesPerPixel() const { return index_data ? 1 : sizeof(uint32_t); }
+		uint64_t Bytes() const {
+			return xdim * ydim * BytesPerPixel() * num_bitmaps + num_entries * sizeof(uint16_t);
+		}
+		void Free() {
+			if (tile_mapping.base)
+				tile_mapping.Unmap();
+			tile_data = NULL;
+			index_data = NULL;
+			tile_map = NULL;
+		}
 	};
 
 	struct Window {
@@ -133,6 +350,8 @@ private:
 		uint64_t tile_ycount;
 		uint8_t* tilesets = NULL;
 		uint8_t* tile_indexes = NULL;
+		uint32_t* palette = NULL;	// 256 colours for the tiles of palette_tileset, NULL to use its own
+		uint8_t palette_tileset = 0;	// the tileset palette was copied from, others keep theirs
 		Window()
 			: enabled(0), black_or_wrap(false)
 			, screen_xcount(0), screen_ycount(0)
@@ -140,10 +359,72 @@ private:
 			, tile_xbegin(0), tile_ybegin(0)
 			, tile_xdim(0), tile_ydim(0)
 			, tile_xcount(0), tile_ycount(0)
-			, tilesets(), tile_indexes()
+			, tilesets(), tile_indexes(), palette()
 		{}
 	};
 
+	// The geometry of an enabled window, taken from the Window when its plan is rebuilt
+	struct WindowDraw {
+		int32_t clip_xbegin;	// visible screen rectangle, end excluded
+		int32_t clip_ybegin;
+		int32_t clip_xend;
+		int32_t clip_yend;
+		uint32_t tile_xorigin;	// tile array pixel at screen 0,0, wrapped into the span
+		uint32_t tile_yorigin;
+		uint32_t tile_xspan;	// tile array size in pixels
+		uint32_t tile_yspan;
+		uint16_t tile_xdim;
+		uint16_t tile_ydim;
+		uint16_t tile_xcount;
+		int32_t layer_xoffset;	// layer pixel at the clip rectangle's top left
+		int32_t layer_yoffset;
+	};
+
+	// A tile of a window as the renderer draws it
+	struct TileRef {
+		const uint8_t* pixels;		// ARGB, or indexes if palette is set. NULL draws nothing.
+		const uint32_t* palette;
+	};
+
+	// Visible pixels of a row that come from one tile column
+	struct ColumnRun {
+		uint16_t screen_x;
+		uint16_t tile_xindex;
+		uint16_t tile_xoffset;
+		uint16_t count;
+	};
+
+	// Opaque pixels of a layer row
+	struct LayerRun {
+		uint16_t x;
+		uint16_t count;
+	};
+
+	static const uint8_t RENDER_PLAN_GEOMETRY = 1;	// position, view or size changed
+	static const uint8_t RENDER_PLAN_TILES = 2;		// tile map, palette or tilesets changed
+	static const uint8_t RENDER_PLAN_LAYER = 4;		// what the window shows changed, not just where
+	// frames a window must stay unchanged before it is drawn into a layer
+	static const uint32_t LAYER_STEADY_FRAMES = 8;
+
+	// Everything DrawWindowsIntoBuffer works out for a window, kept until a
+	// command changes what it was built from
+	struct RenderPlan {
+		uint8_t stale = RENDER_PLAN_GEOMETRY | RENDER_PLAN_TILES;
+		bool visible = false;
+		WindowDraw draw;
+		std::vector<uint32_t> row_entries;	// per visible row, first tile entry of its tile row
+		std::vector<uint32_t> row_pixels;	// per visible row, first pixel of the row within a tile
+		std::vector<ColumnRun> column_runs;
+		std::vector<TileRef> tiles;			// per tile entry of the window
+		// A window that stays the same is drawn once into its own layer,
+		// and the layer's opaque runs are copied in later frames
+		uint32_t steady_frames = 0;
+		bool has_layer = false;
+		std::vector<uint32_t> layer;		// screen_xcount * screen_ycount pixels
+		std::vector<LayerRun> layer_runs;
+		std::vector<uint32_t> layer_rows;	// first run of each row, then the end
+	};
+
 	//////////////////////////////////////////////////////////////////////////
 	// Internal methods
 	//////////////////////////////////////////////////////////////////////////
@@ -153,32 +434,66 @@ private:
 		return (uint64_t)high * 256 * 256 + (uint64_t)med * 256 + low;
 	}
 	bool DataSizeCheck(uint64_t offset, uint64_t data_size) {
-		if (offset + data_size >= sizeof(uploaded_data_region)) {
+		if (offset + data_size >= uploaded_data_region_size) {
 			CommandError("data not bounded by uploaded data region");
 			return false;
 		}
 		return true;
 	}
 
-	void DefineTileset(uint8_t tileset_index, uint16_t num_entries, uint8_t xdim, uint8_t ydim,
+	// Waits for the asset unless the tiles are in the disk cache
+	bool DefineTileset(uint8_t tileset_index, uint16_t num_entries, uint8_t xdim, uint8_t ydim,
 		ImageAsset* asset, uint8_t* offsets);
+	void UpdateTilesetGauge();
+	// Runs the commands between begin and end
+	bool ExecuteCommands(uint8_t* begin, uint8_t* end);
+	// Sets all tiles of the window from tileset/index pairs, false if one is invalid
+	bool SetWindowTiles(Window* w, const uint8_t* entries, uint64_t tile_count);
+	// Number of entries of each tileset usable in the window, 0 if the tile size differs
+	void WindowTileLimits(const Window* w, uint16_t limits[256]);
+	// Keeps enabled_windows in step with the window's enabled flag
+	void SetWindowEnabled(uint8_t window_index, bool enabled);
+	// parts is RENDER_PLAN_GEOMETRY and/or RENDER_PLAN_TILES
+	void InvalidateRenderPlan(uint8_t window_index, uint8_t parts);
+	void BuildPlanGeometry(uint8_t window_index);
+	void BuildPlanTiles(uint8_t window_index);
+	// false if the layer would go over layer_cache_budget
+	bool BuildLayer(uint8_t window_index);
+	void DropLayer(RenderPlan* plan);
+	// Writes count tileset/index pairs from tile first on, already validated
+	void ScatterTiles(Window* w, uint64_t first, const uint8_t* entries, uint64_t count);
 
 
 //////////////////////////////////////////////////////////////////////////
 // Internal data
 //////////////////////////////////////////////////////////////////////////
 	uint8_t* a2mem;	// The current state of the Apple 2 memory ($0200-$BFFF)
+	MappedRegion a2mem_mapping;
 	
 	bool m_bEnabled;
+	bool tile_dedup;	// store identical tiles of a tileset once, SDHR_TILE_DEDUP=0 turns it off
+	bool indexed_tiles;	// store tiles of assets with a palette as indexes, SDHR_INDEXED_TILES=0 turns it off
+	uint64_t layer_cache_budget = 16ull << 20;	// SDHR_LAYER_CACHE_MB, 0 turns window layers off
+	uint64_t layer_cache_bytes = 0;
 
 	static const uint16_t screen_xcount = 640;
 	static const uint16_t screen_ycount = 360;
+	static const uint64_t uploaded_data_region_size = 256 * 256 * 256;
 
 	std::vector<uint8_t> command_buffer;
+	std::vector<uint8_t> upload_scratch;	// inflated SET_UPLOAD tile maps, kept between commands
+	Inflater inflater;
+	std::vector<uint8_t> decompress_scratch;	// commands inside a COMPRESSED command
+	bool in_compressed = false;
 	bool error_flag;
 	char error_str[256];
-	uint8_t uploaded_data_region[256 * 256 * 256];
+	MappedRegion upload_mapping;	// only uploaded pages are committed
+	uint8_t* uploaded_data_region;	// upload_mapping.base
 	ImageAsset image_assets[256];
+	TileAtlas tile_atlas;	// before tileset_records, which point into it
 	TilesetRecord tileset_records[256];
 	Window windows[256];
+	std::vector<uint8_t> enabled_windows;	// indexes of the enabled windows, in drawing order
+	RenderPlan render_plans[256];
 };
+
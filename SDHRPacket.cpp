@@ -0,0 +1,81 @@
+#include "SDHRPacket.h"
+#include "FrameTiming.h"
+#include "Logger.h"
+#include "Metrics.h"
+
+SDHRPacketResult_e HandleSDHRPacket(SDHRManager* sdhrMgr, const SDHRPacket& packet)
+{
+	Metrics::Add(METRIC_PACKETS_RECEIVED);
+	Metrics::Add(METRIC_BYTES_RECEIVED, sizeof(packet));
+	SDHR_LOG_TRACE("Received packet: address: %x data: %x pad: %x",
+		(uint32_t)packet.addr, (uint32_t)packet.data, (uint32_t)packet.pad);
+	FrameTiming* frameTiming = FrameTiming::GetInstance();
+	frameTiming->MarkBatchPacket();
+
+	if ((packet.addr >= 0x200) && (packet.addr <= 0xbfff))
+	{
+		// it's a memory write
+		Metrics::Add(METRIC_MEMORY_WRITE_PACKETS);
+		sdhrMgr->GetApple2MemPtr()[packet.addr] = packet.data;
+		return SDHR_PACKET_HANDLED;
+	}
+	if ((packet.addr != CXSDHR_CTRL) && (packet.addr != CXSDHR_DATA))
+	{
+		// BAD PACKET TYPE
+		Metrics::Add(METRIC_BAD_PACKETS);
+		SDHR_LOG_ERROR("BAD PACKET! addr %x, data %x", (uint32_t)packet.addr, (uint32_t)packet.data);
+		return SDHR_PACKET_BAD;
+	}
+	SDHRCtrl_e _ctrl;
+	switch (packet.addr & 0x0f) 
+	{
+	case 0x00:
+		// std::cout << "This is a control packet!" << std::endl;
+		Metrics::Add(METRIC_CONTROL_PACKETS);
+		_ctrl = (SDHRCtrl_e)packet.data;
+		switch (_ctrl)
+		{
+		case SDHR_CTRL_DISABLE:
+			SDHR_LOG_INFO("CONTROL: Disable SDHR");
+			sdhrMgr->ToggleSdhr(false);
+			break;
+		case SDHR_CTRL_ENABLE:
+			SDHR_LOG_INFO("CONTROL: Enable SDHR");
+			sdhrMgr->ToggleSdhr(true);
+			break;
+		case SDHR_CTRL_RESET:
+			SDHR_LOG_INFO("CONTROL: Reset SDHR");
+			sdhrMgr->ResetSdhr();
+			break;
+		case SDHR_CTRL_PROCESS:
+		{
+			/*
+			At this point we have a complete set of commands to process.
+			Some more data may be in the kernel socket receive buffer, but we don't care.
+			They'll be processed in the next batch.
+			*/
+			// std::cout << "CONTROL: Process SDHR" << std::endl;
+			frameTiming->MarkStage(FRAME_STAGE_PACKET_RECEIVED);
+			frameTiming->MarkStage(FRAME_STAGE_PROCESS_START);
+			bool processingSucceeded = sdhrMgr->ProcessCommands();
+			frameTiming->MarkStage(FRAME_STAGE_PROCESS_END);
+			// Whether or not the processing worked, clear the buffer. If the processing failed,
+			// the data was corrupt and shouldn't be reprocessed
+			sdhrMgr->ClearBuffer();
+			if (processingSucceeded && sdhrMgr->IsSdhrEnabled())
+				return SDHR_PACKET_DRAW;
+			Metrics::Add(METRIC_FRAMES_SKIPPED);
+			break;
+		}
+		default:
+			break;
+		}
+		break;
+	case 0x01:
+		// std::cout << "This is a data packet" << std::endl;
+		Metrics::Add(METRIC_DATA_PACKETS);
+		sdhrMgr->AddPacketDataToBuffer(packet.data);
+		break;
+	}
+	return SDHR_PACKET_HANDLED;
+}
@@ -0,0 +1,33 @@
+// Apple 2 Super Duper High Resolution
+// Bus packets as received from the client, and their decoding
+
+#pragma once
+
+#include <stdint.h>
+#include "SDHRManager.h"
+
+#define CXSDHR_CTRL 0xC0B0	// SDHR command
+#define CXSDHR_DATA 0xC0B1	// SDHR data
+
+#pragma pack(push, 1)
+struct SDHRPacket {
+	uint16_t addr;
+	uint8_t data;
+	uint8_t pad;
+};
+#pragma pack(pop)
+
+enum SDHRPacketResult_e {
+	SDHR_PACKET_HANDLED = 0,	// nothing else to do
+	SDHR_PACKET_DRAW,			// commands were processed and SDHR is enabled: draw a new frame
+	SDHR_PACKET_BAD,			// unknown address
+};
+
+/**
+ * Applies a single bus packet: memory writes go to a2mem, data packets are
+ * queued in the command buffer and control packets are executed, including
+ * SDHR_CTRL_PROCESS which runs the queued commands.
+ * This is the packet loop of the server without the socket and DRM parts,
+ * so it can be driven by the replay tool and the benchmarks.
+ */
+SDHRPacketResult_e HandleSDHRPacket(SDHRManager* sdhrMgr, const SDHRPacket& packet);
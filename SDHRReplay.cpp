@@ -0,0 +1,255 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "SDHRManager.h"
+#include "SDHRPacket.h"
+#include "Capture.h"
+#include "DiskCache.h"
+#include "FrameTiming.h"
+#include "HeadlessFramebuffer.h"
+#include "XXHash64.h"
+
+/**
+ *
+ * SDHRReplay
+ * Feeds a capture recorded with SDHR_RECORD back through the server pipeline:
+ * packet decode, ProcessCommands and DrawWindowsIntoBuffer, into a pair of
+ * framebuffers in memory that are swapped after every frame like the DRM ones.
+ * By default packets are replayed as fast as possible. With --realtime they
+ * are replayed at the pace they were recorded, which shows whether a build
+ * keeps up with a real session.
+ * Every loop starts from a reset SDHR state, so loops are identical.
+ *
+ * Every rendered frame can be hashed (XXH64 of the framebuffer) to check that
+ * renderer changes are bit-exact: --hash-out writes the hashes of the first loop
+ * to a baseline file, --hash-check compares them with a baseline and exits
+ * with 1 on any difference. When hashing, later loops are also compared with
+ * the first one, which catches nondeterministic rendering.
+ *
+ * Usage: SDHRReplay [--realtime] [--loops <n>] [--json]
+ *                   [--hash-out <file>] [--hash-check <file>] <capture>
+ *
+ */
+
+typedef std::chrono::steady_clock ReplayClock;
+
+struct ReplayStats {
+	uint64_t packets = 0;
+	uint64_t frames = 0;
+	uint64_t bad_packets = 0;
+	double wall_s = 0;
+	double process_s = 0;					// PROCESS packets, which run the queued commands
+	std::vector<double> render_us;			// per frame
+	std::vector<uint64_t> hashes;			// per frame of the first loop
+	uint64_t nondeterministic_frames = 0;	// later loop frames that differ from the first loop
+};
+
+static bool WriteHashes(const char* path, const char* capture_path, const std::vector<uint64_t>& hashes)
+{
+	FILE* f = fopen(path, "w");
+	if (f == NULL)
+		return false;
+	fprintf(f, "# SDHRReplay frame hashes (XXH64)\n# capture %s\n", capture_path);
+	for (size_t i = 0; i < hashes.size(); ++i)
+		fprintf(f, "%zu %016llx\n", i, (unsigned long long)hashes[i]);
+	return fclose(f) == 0;
+}
+
+static bool ReadHashes(const char* path, std::vector<uint64_t>& hashes)
+{
+	FILE* f = fopen(path, "r");
+	if (f == NULL)
+		return false;
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long frame, hash;
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%llu %llx", &frame, &hash) == 2) {
+			if (hashes.size() <= frame)
+				hashes.resize(frame + 1, 0);
+			hashes[frame] = hash;
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+static double Percentile(std::vector<double>& v, double p)
+{
+	if (v.empty())
+		return 0;
+	std::sort(v.begin(), v.end());
+	size_t i = std::min(v.size() - 1, (size_t)(p * v.size()));
+	return v[i];
+}
+
+int main(int argc, char* argv[])
+{
+	bool realtime = false;
+	bool json = false;
+	int loops = 1;
+	const char* path = NULL;
+	const char* hash_out = NULL;
+	const char* hash_check = NULL;
+	bool usage = false;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--realtime") == 0)
+			realtime = true;
+		else if (strcmp(argv[i], "--json") == 0)
+			json = true;
+		else if (strcmp(argv[i], "--loops") == 0 && i + 1 < argc)
+			loops = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--hash-out") == 0 && i + 1 < argc)
+			hash_out = argv[++i];
+		else if (strcmp(argv[i], "--hash-check") == 0 && i + 1 < argc)
+			hash_check = argv[++i];
+		else if (argv[i][0] != '-' && path == NULL)
+			path = argv[i];
+		else
+			usage = true;
+	}
+	if (usage || path == NULL) {
+		fprintf(stderr, "Usage: %s [--realtime] [--loops <n>] [--json] [--hash-out <file>] [--hash-check <file>] <capture>\n",
+			argv[0]);
+		return 1;
+	}
+
+	CaptureReader capture;
+	if (!capture.Load(path)) {
+		fprintf(stderr, "SDHRReplay: %s\n", capture.Error().c_str());
+		return 1;
+	}
+	const std::vector<CaptureRecord>& records = capture.Records();
+	std::vector<uint64_t> baseline;
+	if (hash_check && !ReadHashes(hash_check, baseline)) {
+		fprintf(stderr, "SDHRReplay: cannot read %s: %m\n", hash_check);
+		return 1;
+	}
+	bool hashing = (hash_out || hash_check);
+
+	DiskCache::GetInstance()->Initialize();
+	SDHRManager* sdhrMgr = SDHRManager::GetInstance();
+	FrameTiming* frameTiming = FrameTiming::GetInstance();
+	HeadlessFramebuffer framebuffers[2] = { HeadlessFramebuffer(640, 360), HeadlessFramebuffer(640, 360) };
+	int front = 0;
+	ReplayStats stats;
+
+	auto replay_start = ReplayClock::now();
+	for (int loop = 0; loop < loops; ++loop) {
+		sdhrMgr->ResetSdhr();
+		for (HeadlessFramebuffer& fb : framebuffers)
+			fb.Clear();
+		size_t loop_frame = 0;
+		auto loop_start = ReplayClock::now();
+		for (const CaptureRecord& r : records) {
+			if (realtime)
+				std::this_thread::sleep_until(loop_start + std::chrono::microseconds(r.time_us));
+			// the server keeps its state across client connections
+			if (r.packet.addr == CAPTURE_SESSION_ADDR)
+				continue;
+			bool is_process = (r.packet.addr == CXSDHR_CTRL && r.packet.data == SDHR_CTRL_PROCESS);
+			auto t0 = ReplayClock::now();
+			SDHRPacketResult_e result = HandleSDHRPacket(sdhrMgr, r.packet);
+			if (is_process)
+				stats.process_s += std::chrono::duration<double>(ReplayClock::now() - t0).count();
+			++stats.packets;
+			if (result == SDHR_PACKET_BAD) {
+				++stats.bad_packets;
+			}
+			else if (result == SDHR_PACKET_DRAW) {
+				// draw into the back buffer, then "flip"
+				HeadlessFramebuffer& back = framebuffers[front ^ 1];
+				auto r0 = ReplayClock::now();
+				frameTiming->MarkStage(FRAME_STAGE_RENDER_START);
+				sdhrMgr->DrawWindowsIntoBuffer(&back.buf);
+				frameTiming->MarkStage(FRAME_STAGE_RENDER_END);
+				stats.render_us.push_back(std::chrono::duration<double, std::micro>(ReplayClock::now() - r0).count());
+				front ^= 1;
+				++stats.frames;
+				if (hashing) {
+					uint64_t hash = XXHash64(back.buf.map, back.buf.size);
+					if (loop == 0)
+						stats.hashes.push_back(hash);
+					else if (loop_frame >= stats.hashes.size() || stats.hashes[loop_frame] != hash)
+						++stats.nondeterministic_frames;
+				}
+				++loop_frame;
+			}
+		}
+	}
+	stats.wall_s = std::chrono::duration<double>(ReplayClock::now() - replay_start).count();
+
+	int status = 0;
+	if (hash_out && !WriteHashes(hash_out, path, stats.hashes)) {
+		fprintf(stderr, "SDHRReplay: cannot write %s: %m\n", hash_out);
+		status = 1;
+	}
+	int64_t first_mismatch = -1;
+	uint64_t mismatches = 0;
+	if (hash_check) {
+		size_t n = std::max(baseline.size(), stats.hashes.size());
+		for (size_t i = 0; i < n; ++i) {
+			bool same = (i < baseline.size() && i < stats.hashes.size() && baseline[i] == stats.hashes[i]);
+			if (!same) {
+				if (first_mismatch < 0)
+					first_mismatch = (int64_t)i;
+				++mismatches;
+			}
+		}
+		if (mismatches) {
+			fprintf(stderr, "SDHRReplay: %llu of %zu frames differ from %s, first is frame %lld",
+				(unsigned long long)mismatches, n, hash_check, (long long)first_mismatch);
+			if (baseline.size() != stats.hashes.size())
+				fprintf(stderr, " (baseline has %zu frames, replay %zu)", baseline.size(), stats.hashes.size());
+			fprintf(stderr, "\n");
+			status = 1;
+		}
+	}
+	if (stats.nondeterministic_frames) {
+		fprintf(stderr, "SDHRReplay: %llu frames of later loops differ from the first loop\n",
+			(unsigned long long)stats.nondeterministic_frames);
+		status = 1;
+	}
+
+	double recorded_s = records.empty() ? 0 : records.back().time_us / 1e6;
+	double render_s = 0;
+	for (double us : stats.render_us)
+		render_s += us / 1e6;
+	double render_p50 = Percentile(stats.render_us, 0.5);
+	double render_p99 = Percentile(stats.render_us, 0.99);
+	double render_max = stats.render_us.empty() ? 0 : stats.render_us.back();
+	if (json) {
+		printf("{\"capture\":\"%s\",\"sessions\":%llu,\"realtime\":%s,\"loops\":%d,\"recorded_s\":%.3f,"
+			"\"packets\":%llu,\"bad_packets\":%llu,\"frames\":%llu,\"wall_s\":%.6f,\"process_s\":%.6f,\"render_s\":%.6f,"
+			"\"packets_per_s\":%.0f,\"frames_per_s\":%.1f,"
+			"\"render_us\":{\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f},"
+			"\"hash_mismatches\":%llu,\"nondeterministic_frames\":%llu}\n",
+			path, (unsigned long long)capture.Sessions(), realtime ? "true" : "false", loops, recorded_s,
+			(unsigned long long)stats.packets, (unsigned long long)stats.bad_packets, (unsigned long long)stats.frames,
+			stats.wall_s, stats.process_s, render_s,
+			stats.packets / stats.wall_s, stats.frames / stats.wall_s,
+			render_p50, render_p99, render_max,
+			(unsigned long long)mismatches, (unsigned long long)stats.nondeterministic_frames);
+	}
+	else {
+		printf("Capture:   %s, %zu packets over %.3f s", path, records.size() - capture.Sessions(), recorded_s);
+		if (capture.Sessions())
+			printf(", %llu client session(s)", (unsigned long long)capture.Sessions());
+		printf("\n");
+		printf("Replayed:  %d loop(s) %s in %.3f s\n", loops, realtime ? "at recorded pace" : "as fast as possible", stats.wall_s);
+		printf("Packets:   %llu (%llu bad), %.0f packets/s\n",
+			(unsigned long long)stats.packets, (unsigned long long)stats.bad_packets, stats.packets / stats.wall_s);
+		printf("Frames:    %llu, %.1f frames/s\n", (unsigned long long)stats.frames, stats.frames / stats.wall_s);
+		printf("Process:   %.3f ms total\n", stats.process_s * 1000);
+		printf("Render:    %.3f ms total, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+			render_s * 1000, render_p50, render_p99, render_max);
+		if (hash_check)
+			printf("Hashes:    %s %s\n", mismatches ? "differ from" : "match", hash_check);
+	}
+	return status;
+}
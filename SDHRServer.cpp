@@ -4,6 +4,13 @@
 #include <unistd.h>
 #include <cstring>
 #include "SDHRManager.h"
+#include "SDHRPacket.h"
+#include "FrameTiming.h"
+#include "Logger.h"
+#include "Trace.h"
+#include "Metrics.h"
+#include "Capture.h"
+#include "DiskCache.h"
 #include "DrawVBlank_implem.h"
 
 /**
@@ -28,23 +35,16 @@
  * 
  */
 
-#define CXSDHR_CTRL 0xC0B0	// SDHR command
-#define CXSDHR_DATA 0xC0B1	// SDHR data
-
 static SDHRManager* sdhrMgr;
 
-#pragma pack(push, 1)
-struct SDHRPacket {
-	uint16_t addr;
-	uint8_t data;
-	uint8_t pad;
-};
-#pragma pack(pop)
-
 int main() {
+	Tracer::GetInstance()->Initialize();
 	sdhrMgr = SDHRManager::GetInstance();
-
-	uint8_t* a2mem = sdhrMgr->GetApple2MemPtr();
+	FrameTiming::GetInstance()->MapSharedMemory();
+	Metrics::GetInstance()->StartServer();
+	DiskCache::GetInstance()->Initialize();
+	CaptureWriter* capture = CaptureWriter::GetInstance();
+	capture->Initialize();
 
 	// commands socket and descriptors
 	int server_fd, client_fd;
@@ -73,7 +73,7 @@ int main() {
 
 	if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) 
 	{
-		std::cerr << "Error creating socket" << std::endl;
+		SDHR_LOG_ERROR("Error creating socket");
 		return 1;
 	}
 
@@ -84,13 +84,13 @@ int main() {
 
 	if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) 
 	{
-		std::cerr << "Error binding socket" << std::endl;
+		SDHR_LOG_ERROR("Error binding socket");
 		return 1;
 	}
 
 	if (listen(server_fd, 1) == -1) 
 	{
-		std::cerr << "Error listening on socket" << std::endl;
+		SDHR_LOG_ERROR("Error listening on socket");
 		return 1;
 	}
 
@@ -98,120 +98,78 @@ int main() {
 	{
 		if ((client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len)) == -1) 
 		{
-			std::cerr << "Error accepting connection" << std::endl;
+			SDHR_LOG_ERROR("Error accepting connection");
 			return 1;
 		}
 
-		std::cout << "Client connected" << std::endl;
+		SDHR_LOG_INFO("Client connected");
+		capture->StartSession();
 
 		SDHRPacket packet;
 		ssize_t bytes_received;
+		uint64_t batch_packets = 0;		// packets received since the last PROCESS
+		uint64_t batch_start_ns = 0;
 
 		while ((bytes_received = recv(client_fd, &packet, sizeof(packet), 0)) > 0) 
 		{
 			if (bytes_received == sizeof(packet)) 
 			{
-				/*
-				std::cout << "Received packet:" << std::endl;
-				std::cout << "  address: " << std::hex << packet.addr << std::endl;
-				std::cout << "  data: " << std::hex << static_cast<unsigned>(packet.data) << std::endl;
-				std::cout << "  pad: " << std::hex << static_cast<unsigned>(packet.pad) << std::endl;
-				*/
-
-				if ((packet.addr >= 0x200) && (packet.addr <= 0xbfff))
-				{
-					// it's a memory write
-					a2mem[packet.addr] = packet.data;
-					continue;
-				}
-				if ((packet.addr != CXSDHR_CTRL) && (packet.addr != CXSDHR_DATA))
+				capture->Record(packet);
+				if (Tracer::IsEnabled())
 				{
-					// BAD PACKET TYPE
-					std::cerr << "BAD PACKET! addr " << std::hex << packet.addr << ", data " << packet.data << std::endl;
-					continue;
+					if (batch_packets++ == 0)
+						batch_start_ns = FrameTiming::NowNs();
+					if (packet.addr == CXSDHR_CTRL && packet.data == SDHR_CTRL_PROCESS)
+					{
+						Tracer::GetInstance()->RecordSpan("recv_batch", batch_start_ns, FrameTiming::NowNs(),
+							"packets", batch_packets);
+						batch_packets = 0;
+					}
 				}
-				SDHRCtrl_e _ctrl;
-				switch (packet.addr & 0x0f) 
+				if (HandleSDHRPacket(sdhrMgr, packet) == SDHR_PACKET_DRAW)
 				{
-				case 0x00:
-					// std::cout << "This is a control packet!" << std::endl;
-					_ctrl = (SDHRCtrl_e)packet.data;
-					switch (_ctrl)
+					/*
+					Continue processing commands until the framebuffer is flipped. Once the framebuffer
+					has flipped, run the framebuffer drawing with the current state and schedule a flip.
+					Rince and repeat.
+					*/
+					// We have processed some commands.
+					// Check if FB flipped since last time. If the FB has flipped, draw!
+					// Drawing is done in the modeset_page_flip_event handler
+					// std::cout << "Checking for page flip..." << std::endl;
+					FD_SET(modeset_fd, &drm_fds);
 					{
-					case SDHR_CTRL_DISABLE:
-						std::cout << "CONTROL: Disable SDHR" << std::endl;
-						sdhrMgr->ToggleSdhr(false);
-						break;
-					case SDHR_CTRL_ENABLE:
-						std::cout << "CONTROL: Enable SDHR" << std::endl;
-						sdhrMgr->ToggleSdhr(true);
-						break;
-					case SDHR_CTRL_RESET:
-						std::cout << "CONTROL: Reset SDHR" << std::endl;
-						sdhrMgr->ResetSdhr();
-						break;
-					case SDHR_CTRL_PROCESS:
+						SDHR_TRACE_SCOPE("wait_flip");
+						ret_drm = select(modeset_fd + 1, &drm_fds, NULL, NULL, NULL);
+					}
+					if (ret_drm < 0)
 					{
-						/*
-						At this point we have a complete set of commands to process.
-						Some more data may be in the kernel socket receive buffer, but we don't care.
-						They'll be processed in the next batch.
-						Continue processing commands until the framebuffer is flipped. Once the framebuffer
-						has flipped, run the framebuffer drawing with the current state and schedule a flip.
-						Rince and repeat.
-						*/
-						// std::cout << "CONTROL: Process SDHR" << std::endl;
-						bool processingSucceeded = sdhrMgr->ProcessCommands();
-						// Whether or not the processing worked, clear the buffer. If the processing failed,
-						// the data was corrupt and shouldn't be reprocessed
-						sdhrMgr->ClearBuffer();
-						if (processingSucceeded && sdhrMgr->IsSdhrEnabled())
-						{
-							// We have processed some commands.
-							// Check if FB flipped since last time. If the FB has flipped, draw!
-							// Drawing is done in the modeset_page_flip_event handler
-							// std::cout << "Checking for page flip..." << std::endl;
-							FD_SET(modeset_fd, &drm_fds);
-							ret_drm	= select(modeset_fd + 1, &drm_fds, NULL, NULL, NULL);
-							if (ret_drm < 0)
-							{
-								fprintf(stderr, "select() failed with %d: %m\n", errno);
-								break;
-							}
-							else if (FD_ISSET(modeset_fd, &drm_fds))
-							{
-								// Page flip has happened, the FD is readable again
-								// We can now trigger a framebuffer draw
-								// std::cout << "Page flip happened! We can draw." << std::endl;
-								drmHandleEvent(modeset_fd, &evctx);
-							}
-						}
-						break;
+						fprintf(stderr, "select() failed with %d: %m\n", errno);
 					}
-					default:
-						break;
+					else if (FD_ISSET(modeset_fd, &drm_fds))
+					{
+						// Page flip has happened, the FD is readable again
+						// We can now trigger a framebuffer draw
+						// std::cout << "Page flip happened! We can draw." << std::endl;
+						drmHandleEvent(modeset_fd, &evctx);
 					}
-					break;
-				case 0x01:
-					// std::cout << "This is a data packet" << std::endl;
-					sdhrMgr->AddPacketDataToBuffer(packet.data);
-					break;
 				}
 			}
 			else 
 			{
-				std::cerr << "Error receiving data or incomplete data" << std::endl;
+				SDHR_LOG_ERROR("Error receiving data or incomplete data");
 			}
 		}
 
 		if (bytes_received == -1) 
 		{
-			std::cerr << "Error receiving data" << std::endl;
+			SDHR_LOG_ERROR("Error receiving data");
 		}
 
-		std::cerr << "Client Closing" << std::endl;
+		SDHR_LOG_INFO("Client Closing");
+		capture->Flush();
 		close(client_fd);
-		std::cerr << "    Client Closed" << std::endl;
+		SDHR_LOG_INFO("    Client Closed");
 	}
 	close(server_fd);
 
@@ -0,0 +1,160 @@
+#include "TileAtlas.h"
+#include "Logger.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+
+// Slabs are at least this big, or one slot for the large size classes
+static const uint64_t TILE_ATLAS_SLAB_BYTES = 2ull << 20;
+
+//////////////////////////////////////////////////////////////////////////
+// Static helpers
+//////////////////////////////////////////////////////////////////////////
+
+static uint64_t RoundUp(uint64_t value, uint64_t multiple)
+{
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+static uint32_t RoundUpPowerOfTwo(uint32_t value)
+{
+	uint32_t p = 16;	// small tilesets share one class
+	while (p < value)
+		p <<= 1;
+	return p;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Methods
+//////////////////////////////////////////////////////////////////////////
+
+TileAtlas::TileAtlas()
+	: reserved_bytes(0)
+{
+	long ps = sysconf(_SC_PAGESIZE);
+	page_size = ps > 0 ? (uint64_t)ps : 4096;
+}
+
+TileAtlas::~TileAtlas()
+{
+	for (MappedRegion& slab : slabs)
+		slab.Unmap();
+}
+
+uint32_t TileAtlas::FindSizeClass(uint64_t tile_bytes, uint32_t tile_count)
+{
+	uint32_t count = RoundUpPowerOfTwo(tile_count);
+	for (uint32_t i = 0; i < size_classes.size(); ++i) {
+		if (size_classes[i].tile_bytes == tile_bytes && size_classes[i].tile_count == count)
+			return i;
+	}
+	SizeClass c;
+	c.tile_bytes = tile_bytes;
+	c.tile_count = count;
+	c.slot_bytes = RoundUp(tile_bytes * count + count * sizeof(uint16_t), page_size);
+	size_classes.push_back(c);
+	return (uint32_t)size_classes.size() - 1;
+}
+
+bool TileAtlas::AddSlab(uint32_t size_class)
+{
+	SizeClass& c = size_classes[size_class];
+	uint64_t slots_per_slab = TILE_ATLAS_SLAB_BYTES / c.slot_bytes;
+	if (slots_per_slab == 0)
+		slots_per_slab = 1;
+	MappedRegion slab;
+	// the whole slab size even if the slots leave a gap, so it can be one huge page
+	if (!slab.Map(std::max(TILE_ATLAS_SLAB_BYTES, slots_per_slab * c.slot_bytes), METRIC_REGION_TILE_ATLAS))
+		return false;
+	slabs.push_back(slab);
+	reserved_bytes += slab.size;
+	// handed out from the front of the slab first
+	for (uint64_t i = slots_per_slab; i-- > 0;) {
+		Slot s = { slab.base + i * c.slot_bytes, size_class, 0, 0, false, slab.IsHuge() };
+		c.free_slots.push_back((uint32_t)slots.size());
+		slots.push_back(s);
+	}
+	SDHR_LOG_DEBUG("TileAtlas: new slab of %llu slots for %llu byte tiles", (unsigned long long)slots_per_slab,
+		(unsigned long long)c.tile_bytes);
+	return true;
+}
+
+void TileAtlas::Release(Slot& slot)
+{
+	if (slot.touched_bytes && !slot.huge)
+		madvise(slot.base, RoundUp(slot.touched_bytes, page_size), MADV_DONTNEED);
+	slot.touched_bytes = 0;
+	slot.in_use = false;
+	size_classes[slot.size_class].free_slots.push_back((uint32_t)(&slot - slots.data()));
+}
+
+TileAtlasHandle TileAtlas::Allocate(uint64_t tile_bytes, uint32_t tile_count, TileAtlasHandle reuse)
+{
+	TileAtlasHandle handle;
+	if (Data(reuse)) {
+		Slot& s = slots[reuse.slot];
+		const SizeClass& c = size_classes[s.size_class];
+		if (c.tile_bytes == tile_bytes && c.tile_count >= tile_count) {
+			if (++s.generation == 0)
+				s.generation = 1;
+			handle.slot = reuse.slot;
+			handle.generation = s.generation;
+			return handle;
+		}
+		Free(reuse);
+	}
+
+	uint32_t size_class = FindSizeClass(tile_bytes, tile_count);
+	if (size_classes[size_class].free_slots.empty() && !AddSlab(size_class))
+		return handle;
+	SizeClass& c = size_classes[size_class];
+	uint32_t index = c.free_slots.back();
+	c.free_slots.pop_back();
+	Slot& s = slots[index];
+	s.in_use = true;
+	if (++s.generation == 0)
+		s.generation = 1;
+	handle.slot = index;
+	handle.generation = s.generation;
+	return handle;
+}
+
+void TileAtlas::Free(TileAtlasHandle& handle)
+{
+	if (Data(handle))
+		Release(slots[handle.slot]);
+	handle = TileAtlasHandle();
+}
+
+void TileAtlas::FreeAll()
+{
+	for (Slot& s : slots) {
+		if (s.in_use)
+			Release(s);
+	}
+}
+
+uint8_t* TileAtlas::Data(TileAtlasHandle handle) const
+{
+	if (!handle.IsValid() || handle.slot >= slots.size())
+		return NULL;
+	const Slot& s = slots[handle.slot];
+	if (!s.in_use || s.generation != handle.generation)
+		return NULL;
+	return s.base;
+}
+
+void TileAtlas::Trim(TileAtlasHandle handle, uint64_t used_bytes)
+{
+	if (!Data(handle))
+		return;
+	Slot& s = slots[handle.slot];
+	if (s.huge)
+		return;		// giving back part of a huge page would split it
+	uint64_t keep = RoundUp(used_bytes, page_size);
+	uint64_t touched = RoundUp(s.touched_bytes, page_size);
+	if (touched > keep)
+		madvise(s.base + keep, touched - keep, MADV_DONTNEED);
+	s.touched_bytes = used_bytes;
+}
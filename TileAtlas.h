@@ -0,0 +1,76 @@
+// Apple 2 Super Duper High Resolution
+// Shared arena for tileset tile data
+//
+// Tilesets don't malloc their tiles. They get a slot in the atlas, sized for
+// a number of tiles followed by the tile map. Slots come in size classes,
+// keyed by the tile size in bytes and the tile count rounded up to a power
+// of two, and each class carves its slots out of page-aligned slabs. Tiles of
+// the same size sit next to each other, and a long session doesn't fragment
+// the heap. Slabs are anonymous mappings, so the kernel only commits the pages
+// that get written. Pages a slot no longer uses go back with MADV_DONTNEED,
+// except in slabs that got huge pages (see MappedRegion.h), where that would
+// split the huge page.
+//
+// A handle is a slot plus a generation. Redefining a tileset with the same
+// tile size reuses its slot in place under a new generation, so stale handles
+// are detected instead of reading someone else's tiles.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "MappedRegion.h"
+
+struct TileAtlasHandle {
+	uint32_t slot = 0;
+	uint32_t generation = 0;	// 0 is never a live generation
+	bool IsValid() const { return generation != 0; }
+};
+
+class TileAtlas
+{
+public:
+	// Returns a slot with room for tile_count tiles of tile_bytes each, and
+	// a uint16_t tile map after them. reuse is freed, unless its slot is
+	// big enough and of the same tile size: then it comes back as is,
+	// with a new generation. Invalid if the memory can't be mapped.
+	TileAtlasHandle Allocate(uint64_t tile_bytes, uint32_t tile_count, TileAtlasHandle reuse = TileAtlasHandle());
+	void Free(TileAtlasHandle& handle);
+	void FreeAll();
+	// NULL for a stale or invalid handle
+	uint8_t* Data(TileAtlasHandle handle) const;
+	// Gives back the pages of the slot beyond used_bytes
+	void Trim(TileAtlasHandle handle, uint64_t used_bytes);
+
+	uint64_t ReservedBytes() const { return reserved_bytes; }
+
+	TileAtlas();
+	~TileAtlas();
+	TileAtlas(const TileAtlas&) = delete;
+	TileAtlas& operator=(const TileAtlas&) = delete;
+private:
+	struct Slot {
+		uint8_t* base;
+		uint32_t size_class;
+		uint32_t generation;	// of the live handle, or of the last one when free
+		uint64_t touched_bytes;	// pages up to here may be committed
+		bool in_use;
+		bool huge;	// in a slab with huge pages, never trimmed
+	};
+	struct SizeClass {
+		uint64_t tile_bytes;
+		uint32_t tile_count;
+		uint64_t slot_bytes;
+		std::vector<uint32_t> free_slots;
+	};
+	uint32_t FindSizeClass(uint64_t tile_bytes, uint32_t tile_count);
+	bool AddSlab(uint32_t size_class);
+	void Release(Slot& slot);
+
+	std::vector<Slot> slots;
+	std::vector<SizeClass> size_classes;
+	std::vector<MappedRegion> slabs;
+	uint64_t reserved_bytes;
+	uint64_t page_size;
+};
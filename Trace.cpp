@@ -0,0 +1,176 @@
+#include "Trace.h"
+#include "Logger.h"
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+
+// below because "The declaration of a static data member in its class definition is not a definition"
+Tracer* Tracer::s_instance;
+bool Tracer::s_enabled = false;
+std::atomic<int> Tracer::s_pending_signal(0);
+
+//////////////////////////////////////////////////////////////////////////
+// Static helpers
+//////////////////////////////////////////////////////////////////////////
+
+void Tracer::SignalHandler(int sig)
+{
+	// only async-signal-safe work here, the writer thread does the rest
+	s_pending_signal.store(sig);
+}
+
+void Tracer::WriteAtExit()
+{
+	if (s_instance && s_enabled)
+		s_instance->WriteChromeTrace(s_instance->path.c_str());
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Methods
+//////////////////////////////////////////////////////////////////////////
+
+void Tracer::Initialize()
+{
+#if SDHR_ENABLE_TRACE
+	const char* file = getenv("SDHR_TRACE_FILE");
+	if (file == NULL || *file == 0 || s_enabled)
+		return;
+	path = file;
+	s_enabled = true;
+	// logging first makes the logger's atexit flush run after ours
+	SDHR_LOG_INFO("Tracing enabled, send SIGUSR1 to write %s", path.c_str());
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = Tracer::SignalHandler;
+	sa.sa_flags = SA_RESTART;	// don't interrupt recv() in the main loop
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	atexit(Tracer::WriteAtExit);
+
+	running = true;
+	writer_thread = std::thread(&Tracer::WriterThread, this);
+#endif
+}
+
+Tracer::~Tracer()
+{
+	running = false;
+	if (writer_thread.joinable())
+		writer_thread.join();
+	for (TraceRing* ring : rings)
+		delete ring;
+}
+
+Tracer::TraceRing* Tracer::GetThreadRing()
+{
+	thread_local TraceRing* ring = NULL;
+	if (ring == NULL) {
+		ring = new TraceRing();
+		ring->tid = (uint32_t)syscall(SYS_gettid);
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		rings.push_back(ring);
+	}
+	return ring;
+}
+
+void Tracer::RecordSpan(const char* name, uint64_t start_ns, uint64_t end_ns,
+	const char* arg0_name, int64_t arg0, const char* arg1_name, int64_t arg1)
+{
+	if (!s_enabled)
+		return;
+	TraceRing* ring = GetThreadRing();
+	uint64_t index = ring->head.load(std::memory_order_relaxed);
+	TraceRing::Slot* slot = &ring->slots[index & (TRACE_RING_SIZE - 1)];
+	slot->seq.store(2 * index + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot->event.name = name;
+	slot->event.arg0_name = arg0_name;
+	slot->event.arg1_name = arg1_name;
+	slot->event.arg0 = arg0;
+	slot->event.arg1 = arg1;
+	slot->event.start_ns = start_ns;
+	slot->event.dur_ns = end_ns > start_ns ? end_ns - start_ns : 0;
+	slot->seq.store(2 * (index + 1), std::memory_order_release);
+	ring->head.store(index + 1, std::memory_order_release);
+}
+
+bool Tracer::WriteChromeTrace(const char* out_path)
+{
+	std::lock_guard<std::mutex> write_lock(write_mutex);
+	std::vector<TraceRing*> snapshot;
+	{
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		snapshot = rings;
+	}
+	// write to a temporary file so a reader never sees half a trace
+	std::string tmp_path = std::string(out_path) + ".tmp";
+	FILE* f = fopen(tmp_path.c_str(), "w");
+	if (f == NULL) {
+		SDHR_LOG_ERROR("Cannot write trace file %s: %s", tmp_path.c_str(), strerror(errno));
+		return false;
+	}
+	uint32_t pid = (uint32_t)getpid();
+	uint64_t written = 0;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"SDHRServer\"}}", pid);
+	for (TraceRing* ring : snapshot) {
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+		uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+		for (uint64_t index = first; index < head; ++index) {
+			const TraceRing::Slot* slot = &ring->slots[index & (TRACE_RING_SIZE - 1)];
+			uint64_t expected = 2 * (index + 1);
+			if (slot->seq.load(std::memory_order_acquire) != expected)
+				continue;
+			TraceEvent e = slot->event;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot->seq.load(std::memory_order_relaxed) != expected)
+				continue;
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+				e.name, pid, ring->tid, e.start_ns / 1000.0, e.dur_ns / 1000.0);
+			if (e.arg0_name) {
+				fprintf(f, ",\"args\":{\"%s\":%lld", e.arg0_name, (long long)e.arg0);
+				if (e.arg1_name)
+					fprintf(f, ",\"%s\":%lld", e.arg1_name, (long long)e.arg1);
+				fprintf(f, "}");
+			}
+			fprintf(f, "}");
+			++written;
+		}
+	}
+	fprintf(f, "\n]}\n");
+	bool ok = (fclose(f) == 0);
+	if (ok)
+		ok = (rename(tmp_path.c_str(), out_path) == 0);
+	if (ok)
+		SDHR_LOG_INFO("Wrote %llu trace events to %s", (unsigned long long)written, out_path);
+	else
+		SDHR_LOG_ERROR("Cannot write trace file %s: %s", out_path, strerror(errno));
+	return ok;
+}
+
+void Tracer::WriterThread()
+{
+	while (running.load(std::memory_order_relaxed)) {
+		int sig = s_pending_signal.exchange(0);
+		if (sig == SIGUSR1) {
+			WriteChromeTrace(path.c_str());
+		}
+		else if (sig != 0) {
+			// SIGINT/SIGTERM: write the trace, then let the signal end the
+			// process as it would have without tracing. exit() here would run
+			// the static destructors while the main thread is still using them.
+			WriteChromeTrace(path.c_str());
+			Logger::GetInstance()->Flush();
+			signal(sig, SIG_DFL);
+			raise(sig);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	}
+}
@@ -0,0 +1,126 @@
+// Apple 2 Super Duper High Resolution
+// Pipeline span tracing with Chrome trace export
+//
+// When the SDHR_TRACE_FILE environment variable is set, spans (recv batches,
+// commands, decodes, per-window rendering, DRM flips) are recorded into
+// per-thread rings that keep the most recent events. The rings are written as
+// Chrome trace JSON (loadable in chrome://tracing and ui.perfetto.dev) to that
+// file on SIGUSR1, SIGINT/SIGTERM or at exit.
+// Without SDHR_TRACE_FILE a span costs a single branch. Building with
+// SDHR_ENABLE_TRACE=0 removes the spans altogether.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FrameTiming.h"
+
+#ifndef SDHR_ENABLE_TRACE
+#define SDHR_ENABLE_TRACE 1
+#endif
+
+#define TRACE_RING_SIZE 32768	// events kept per thread, must be a power of 2
+
+#define SDHR_TRACE_CONCAT_(a, b) a##b
+#define SDHR_TRACE_CONCAT(a, b) SDHR_TRACE_CONCAT_(a, b)
+#if SDHR_ENABLE_TRACE
+// SDHR_TRACE_SCOPE(name [, arg0_name, arg0 [, arg1_name, arg1]]) traces until the end of the scope
+#define SDHR_TRACE_SCOPE(...) TraceScope SDHR_TRACE_CONCAT(_trace_scope_, __LINE__)(__VA_ARGS__)
+#else
+#define SDHR_TRACE_SCOPE(...) do {} while (0)
+#endif
+
+class Tracer
+{
+public:
+	// Reads SDHR_TRACE_FILE. Call once from main() before starting other threads.
+	void Initialize();
+
+	// name and arg names must be string literals, they're stored as pointers
+	void RecordSpan(const char* name, uint64_t start_ns, uint64_t end_ns,
+		const char* arg0_name = NULL, int64_t arg0 = 0,
+		const char* arg1_name = NULL, int64_t arg1 = 0);
+	bool WriteChromeTrace(const char* path);
+
+	static bool IsEnabled() {
+		return s_enabled;
+	}
+
+	// public singleton code
+	static Tracer* GetInstance()
+	{
+		if (NULL == s_instance)
+			s_instance = new Tracer();
+		return s_instance;
+	}
+	~Tracer();
+private:
+	static Tracer* s_instance;
+	static bool s_enabled;
+	Tracer() : running(false) {}
+
+	struct TraceEvent {
+		const char* name;
+		const char* arg0_name;
+		const char* arg1_name;
+		int64_t arg0;
+		int64_t arg1;
+		uint64_t start_ns;
+		uint64_t dur_ns;
+	};
+
+	// Single writer, overwrites the oldest events. Slots are seqlocked so
+	// the export can run while the owner keeps tracing.
+	struct TraceRing {
+		std::atomic<uint64_t> head;
+		uint32_t tid;
+		struct Slot {
+			std::atomic<uint64_t> seq;
+			TraceEvent event;
+		} slots[TRACE_RING_SIZE];
+		TraceRing() : head(0), tid(0) {}
+	};
+
+	TraceRing* GetThreadRing();
+	void WriterThread();
+	static void SignalHandler(int sig);
+	static void WriteAtExit();
+
+	std::string path;
+	std::mutex rings_mutex;
+	std::vector<TraceRing*> rings;
+	std::mutex write_mutex;
+	std::atomic<bool> running;
+	std::thread writer_thread;
+	static std::atomic<int> s_pending_signal;
+};
+
+class TraceScope
+{
+public:
+	explicit TraceScope(const char* name,
+		const char* arg0_name = NULL, int64_t arg0 = 0,
+		const char* arg1_name = NULL, int64_t arg1 = 0)
+		: name(name)
+		, arg0_name(arg0_name), arg1_name(arg1_name)
+		, arg0(arg0), arg1(arg1)
+		, start_ns(Tracer::IsEnabled() ? FrameTiming::NowNs() : 0)
+	{}
+	~TraceScope() {
+		if (start_ns)
+			Tracer::GetInstance()->RecordSpan(name, start_ns, FrameTiming::NowNs(),
+				arg0_name, arg0, arg1_name, arg1);
+	}
+private:
+	const char* name;
+	const char* arg0_name;
+	const char* arg1_name;
+	int64_t arg0;
+	int64_t arg1;
+	uint64_t start_ns;
+};
@@ -0,0 +1,55 @@
+#include "WorkerPool.h"
+#include "Logger.h"
+#include <pthread.h>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+// below because "The declaration of a static data member in its class definition is not a definition"
+WorkerPool* WorkerPool::s_instance;
+
+//////////////////////////////////////////////////////////////////////////
+// Methods
+//////////////////////////////////////////////////////////////////////////
+
+WorkerPool::WorkerPool()
+	: stopping(false)
+{
+	size_t count = std::clamp((size_t)std::thread::hardware_concurrency(), (size_t)2, (size_t)5) - 1;
+	const char* env = getenv("SDHR_WORKER_THREADS");
+	if (env && atoi(env) > 0)
+		count = (size_t)atoi(env);
+	for (size_t i = 0; i < count; ++i)
+		threads.emplace_back(&WorkerPool::WorkerThread, this, i);
+	SDHR_LOG_DEBUG("WorkerPool: %zu threads", count);
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		stopping = true;
+	}
+	queue_cv.notify_all();
+	for (std::thread& t : threads)
+		t.join();
+}
+
+void WorkerPool::WorkerThread(size_t index)
+{
+	char name[16];
+	snprintf(name, sizeof(name), "sdhr-worker%zu", index);
+	pthread_setname_np(pthread_self(), name);
+	while (true) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			queue_cv.wait(lock, [this] { return stopping || !queue.empty(); });
+			if (queue.empty())
+				return;
+			task = std::move(queue.front());
+			queue.pop_front();
+		}
+		task();
+	}
+}
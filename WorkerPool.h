@@ -0,0 +1,58 @@
+// Apple 2 Super Duper High Resolution
+// Worker threads for the slow parts of command processing
+//
+// Work such as PNG decoding is submitted as a task and returns a future, so
+// ProcessCommands can go on with the commands that don't need the result.
+// The number of threads is SDHR_WORKER_THREADS, by default one less than the
+// number of cores (at least 1, at most 4).
+
+#pragma once
+
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool
+{
+public:
+	template <typename F>
+	auto Submit(F&& f) -> std::future<decltype(f())> {
+		typedef decltype(f()) R;
+		// packaged_task isn't copyable, std::function needs a copyable callable
+		auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+		std::future<R> result = task->get_future();
+		{
+			std::lock_guard<std::mutex> lock(queue_mutex);
+			queue.emplace_back([task] { (*task)(); });
+		}
+		queue_cv.notify_one();
+		return result;
+	}
+	size_t ThreadCount() const { return threads.size(); }
+
+	// public singleton code
+	static WorkerPool* GetInstance()
+	{
+		if (NULL == s_instance)
+			s_instance = new WorkerPool();
+		return s_instance;
+	}
+	~WorkerPool();
+private:
+	static WorkerPool* s_instance;
+	WorkerPool();
+
+	void WorkerThread(size_t index);
+
+	std::mutex queue_mutex;
+	std::condition_variable queue_cv;
+	std::deque<std::function<void()>> queue;
+	std::vector<std::thread> threads;
+	bool stopping;
+};